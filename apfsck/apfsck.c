@@ -2,27 +2,44 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#define _GNU_SOURCE /* For O_DIRECT */
+#include <pthread.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "apfsck.h"
+#include "block.h"
+#include "stats.h"
 #include "super.h"
 
 int fd;
 unsigned int options;
+unsigned long cache_size = BLOCK_CACHE_DEFAULT_MB << 20;
+unsigned int jobs = 1;
+unsigned int io_engine = IO_ENGINE_PREAD;
+unsigned int queue_depth = IO_DEFAULT_QUEUE_DEPTH;
+char *stats_path;
 static bool weird_state;
 static char *progname;
 
+/*
+ * Serializes the output of the threads that check the volumes.  It's never
+ * released by a thread that is about to exit, so only one issue is reported.
+ */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * usage - Print usage information and exit
  */
-static void usage(void)
+__attribute__((noreturn)) static void usage(void)
 {
-	fprintf(stderr, "usage: %s [-cuvw] device\n", progname);
+	fprintf(stderr, "usage: %s [-cdlpuvw] [-e engine] [-j jobs] [-m cache_mb] "
+		"[-q depth] [-s stats_file] device\n", progname);
 	exit(1);
 }
 
@@ -40,6 +57,7 @@ static void version(void)
  */
 __attribute__((noreturn)) void system_error(void)
 {
+	pthread_mutex_lock(&output_lock);
 	perror(progname);
 	exit(1);
 }
@@ -60,6 +78,7 @@ __attribute__((noreturn, format(printf, 2, 3)))	void report(const char *context,
 	vsnprintf(buf, sizeof(buf), message, args);
 	va_end(args);
 
+	pthread_mutex_lock(&output_lock);
 	if (context)
 		printf("%s: %s\n", context, buf);
 	else
@@ -109,17 +128,68 @@ void report_weird(const char *context)
 	 * Several of my test images have 'weird' issues, so don't exit right
 	 * away.  Remember that an issue was found, for the exit code.
 	 */
+	pthread_mutex_lock(&output_lock);
 	printf("%s: odd inconsistency (may not be corruption).\n", context);
 	weird_state = true;
+	pthread_mutex_unlock(&output_lock);
+}
+
+/**
+ * get_size_mb - Parse a size in MiB from the command line
+ * @arg: the argument string
+ *
+ * Returns the size in bytes.
+ */
+static unsigned long get_size_mb(char *arg)
+{
+	unsigned long size;
+	char *end;
+
+	size = strtoul(arg, &end, 0);
+	if (!*arg || *end || size > (~0UL >> 20))
+		usage();
+	return size << 20;
+}
+
+/**
+ * get_count - Parse a positive count from the command line
+ * @arg:	the argument string
+ * @max:	maximum value allowed
+ */
+static unsigned int get_count(char *arg, unsigned int max)
+{
+	unsigned long count;
+	char *end;
+
+	count = strtoul(arg, &end, 0);
+	if (!*arg || *end || count == 0 || count > max)
+		usage();
+	return count;
+}
+
+/**
+ * get_io_engine - Parse the name of an io engine from the command line
+ * @arg: the argument string
+ */
+static unsigned int get_io_engine(char *arg)
+{
+	if (strcmp(arg, "pread") == 0)
+		return IO_ENGINE_PREAD;
+	if (strcmp(arg, "uring") == 0)
+		return IO_ENGINE_URING;
+	if (strcmp(arg, "mmap") == 0)
+		return IO_ENGINE_MMAP;
+	usage();
 }
 
 int main(int argc, char *argv[])
 {
+	struct stats_timer timer;
 	char *filename;
 
 	progname = argv[0];
 	while (1) {
-		int opt = getopt(argc, argv, "cuvw");
+		int opt = getopt(argc, argv, "cde:j:lm:pq:s:uvw");
 
 		if (opt == -1)
 			break;
@@ -128,6 +198,30 @@ int main(int argc, char *argv[])
 		case 'c':
 			options |= OPT_REPORT_CRASH;
 			break;
+		case 'd':
+			options |= OPT_DIRECT_IO;
+			break;
+		case 'e':
+			io_engine = get_io_engine(optarg);
+			break;
+		case 'j':
+			jobs = get_count(optarg, MAX_JOBS);
+			break;
+		case 'l':
+			options |= OPT_LATEST_ONLY;
+			break;
+		case 'm':
+			cache_size = get_size_mb(optarg);
+			break;
+		case 'p':
+			options |= OPT_PHYSICAL_SWEEP;
+			break;
+		case 'q':
+			queue_depth = get_count(optarg, 4096);
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
 		case 'u':
 			options |= OPT_REPORT_UNKNOWN;
 			break;
@@ -145,11 +239,15 @@ int main(int argc, char *argv[])
 		usage();
 	filename = argv[optind];
 
-	fd = open(filename, O_RDONLY);
+	fd = open(filename, O_RDONLY | (options & OPT_DIRECT_IO ? O_DIRECT : 0));
 	if (fd == -1)
 		system_error();
 
+	stats_timer_start(&timer);
 	parse_filesystem();
+	stats_timer_stop(&timer, "total", -1 /* volume */);
+	write_stats();
+
 	if (weird_state)
 		return 1;
 	return 0;
@@ -9,15 +9,25 @@
 
 /* Declarations for global variables */
 extern unsigned int options;		/* Command line options */
+extern unsigned long cache_size;	/* Memory budget for block cache */
+extern unsigned int jobs;		/* Number of volumes checked at once */
+extern unsigned int io_engine;		/* Engine for reading the device */
+extern unsigned int queue_depth;	/* Maximum reads in flight */
+extern char *stats_path;		/* File for the stats, or NULL */
 extern struct super_block *sb;		/* Filesystem superblock */
-extern struct volume_superblock *vsb;	/* Volume superblock */
+extern __thread struct volume_superblock *vsb; /* Volume superblock */
 extern int fd;				/* File descriptor for the device */
-extern bool ongoing_query;		/* Are we currently running a query? */
 
 /* Option flags */
 #define	OPT_REPORT_CRASH	1 /* Report on-disk signs of a past crash */
 #define OPT_REPORT_UNKNOWN	2 /* Report unknown or unsupported features */
 #define OPT_REPORT_WEIRD	4 /* Report issues that may not be corruption */
+#define OPT_PHYSICAL_SWEEP	8 /* Read whole trees in physical order */
+#define OPT_LATEST_ONLY		16 /* Only check the latest checkpoint */
+#define OPT_DIRECT_IO		32 /* Read the device with O_DIRECT */
+
+/* Upper limit for the number of jobs, to keep the thread pools bounded */
+#define MAX_JOBS	256
 
 extern __attribute__((noreturn, format(printf, 2, 3)))
 		void report(const char *context, const char *message, ...);
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "arena.h"
+
+/* All allocations are aligned to this */
+#define ARENA_ALIGN	sizeof(u64)
+
+/**
+ * alloc_arena - Allocates and returns an empty arena
+ */
+struct arena *alloc_arena(void)
+{
+	struct arena *arena;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		system_error();
+	return arena;
+}
+
+/* Allocations bigger than this get a slab of their own */
+#define ARENA_BIG_ALLOC		(ARENA_SLAB_SIZE / 4)
+
+/**
+ * arena_add_slab - Add a new slab to an arena
+ * @arena:	the arena
+ * @size:	size of the slab, not counting the header
+ *
+ * Returns a pointer to the start of the usable space in the slab.  The slab is
+ * zeroed, so there is no need to clear each allocation.
+ */
+static char *arena_add_slab(struct arena *arena, size_t size)
+{
+	struct arena_slab *slab;
+
+	slab = calloc(1, sizeof(*slab) + size);
+	if (!slab)
+		system_error();
+
+	if (size > ARENA_BIG_ALLOC && arena->a_slabs) {
+		/* Keep the current slab in front, it may still have room */
+		slab->s_next = arena->a_slabs->s_next;
+		arena->a_slabs->s_next = slab;
+	} else {
+		slab->s_next = arena->a_slabs;
+		arena->a_slabs = slab;
+	}
+	return (char *)(slab + 1);
+}
+
+/**
+ * arena_alloc - Allocate zeroed memory from an arena
+ * @arena:	the arena
+ * @size:	number of bytes needed
+ *
+ * The memory stays valid until the arena is freed.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size > ARENA_BIG_ALLOC)
+		return arena_add_slab(arena, size);
+
+	if (size > arena->a_end - arena->a_next) {
+		arena->a_next = arena_add_slab(arena, ARENA_SLAB_SIZE);
+		arena->a_end = arena->a_next + ARENA_SLAB_SIZE;
+	}
+
+	ret = arena->a_next;
+	arena->a_next += size;
+	return ret;
+}
+
+/**
+ * arena_strdup - Copy a null-terminated string into an arena
+ * @arena:	the arena
+ * @str:	the string
+ */
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * free_arena - Free an arena and all the memory allocated from it
+ * @arena: the arena
+ */
+void free_arena(struct arena *arena)
+{
+	struct arena_slab *slab = arena->a_slabs;
+
+	while (slab) {
+		struct arena_slab *next = slab->s_next;
+
+		free(slab);
+		slab = next;
+	}
+	free(arena);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* Size of each slab of memory requested by an arena */
+#define ARENA_SLAB_SIZE		(1 << 20)
+
+/*
+ * Header for a slab of memory in an arena.  The allocations are carved out of
+ * the space that follows it.
+ */
+struct arena_slab {
+	struct arena_slab	*s_next;	/* Previously allocated slab */
+};
+
+/*
+ * Bump allocator for many small records that all share the same lifetime.
+ * Nothing gets freed until the whole arena goes away.
+ */
+struct arena {
+	struct arena_slab	*a_slabs;	/* Most recently allocated slab */
+	char			*a_next;	/* Next free byte in the slab */
+	char			*a_end;		/* End of the slab */
+};
+
+extern struct arena *alloc_arena(void);
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern char *arena_strdup(struct arena *arena, const char *str);
+extern void free_arena(struct arena *arena);
+
+#endif	/* _ARENA_H */
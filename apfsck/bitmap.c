@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#include <stdlib.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "bitmap.h"
+
+/**
+ * alloc_bitmap - Allocate an empty sparse bitmap
+ * @bits:	number of bits in the bitmap
+ * @leaf_bits:	number of bits in each leaf, must be a multiple of 64
+ */
+struct bitmap *alloc_bitmap(u64 bits, u64 leaf_bits)
+{
+	struct bitmap *bmap;
+
+	bmap = calloc(1, sizeof(*bmap));
+	if (!bmap)
+		system_error();
+	bmap->b_leaf_bits = leaf_bits;
+	bmap->b_leaf_count = DIV_ROUND_UP(bits, leaf_bits);
+	bmap->b_leaves = calloc(bmap->b_leaf_count, sizeof(*bmap->b_leaves));
+	if (!bmap->b_leaves)
+		system_error();
+	return bmap;
+}
+
+/**
+ * free_bitmap - Free a sparse bitmap and all of its leaves
+ * @bmap: the bitmap (may be NULL)
+ */
+void free_bitmap(struct bitmap *bmap)
+{
+	u64 i;
+
+	if (!bmap)
+		return;
+	for (i = 0; i < bmap->b_leaf_count; ++i)
+		free(bmap->b_leaves[i]);
+	free(bmap->b_leaves);
+	free(bmap);
+}
+
+/**
+ * bitmap_leaf - Find a leaf of a bitmap, and create it if needed
+ * @bmap:	the bitmap
+ * @index:	index of the leaf
+ *
+ * New leaves are zeroed.  If two threads create the same leaf at once, only
+ * one of them gets to install it, and the other one uses that.
+ */
+u64 *bitmap_leaf(struct bitmap *bmap, u64 index)
+{
+	u64 *leaf, *expected = NULL;
+
+	leaf = bitmap_find_leaf(bmap, index);
+	if (leaf)
+		return leaf;
+
+	leaf = calloc(1, bmap->b_leaf_bits / 8);
+	if (!leaf)
+		system_error();
+	if (__atomic_compare_exchange_n(&bmap->b_leaves[index], &expected, leaf,
+					false /* weak */, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+		return leaf;
+	free(leaf);
+	return expected;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <apfs/types.h>
+
+/*
+ * Sparse bitmap, split into leaves of a fixed size.  Each leaf covers one
+ * chunk of the container, and only gets allocated once a bit inside it is set,
+ * so the memory used is proportional to the space in use, not to the size of
+ * the device.  Leaves can be created by several threads at once.
+ */
+struct bitmap {
+	u64		**b_leaves;	/* Leaf for each chunk, NULL if unset */
+	u64		b_leaf_count;	/* Number of leaves */
+	u64		b_leaf_bits;	/* Number of bits in each leaf */
+};
+
+extern struct bitmap *alloc_bitmap(u64 bits, u64 leaf_bits);
+extern void free_bitmap(struct bitmap *bmap);
+extern u64 *bitmap_leaf(struct bitmap *bmap, u64 index);
+
+/**
+ * bitmap_find_leaf - Find a leaf of a bitmap, without creating it
+ * @bmap:	the bitmap
+ * @index:	index of the leaf
+ *
+ * Returns NULL if no bit inside the leaf was ever set.
+ */
+static inline u64 *bitmap_find_leaf(struct bitmap *bmap, u64 index)
+{
+	return __atomic_load_n(&bmap->b_leaves[index], __ATOMIC_ACQUIRE);
+}
+
+#endif	/* _BITMAP_H */
@@ -0,0 +1,811 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * All reads of metadata blocks go through here.  Recently used blocks are kept
+ * in a cache of bounded size, so that the b-tree nodes that get visited over
+ * and over (by each checkpoint, for example) are only read from disk once.
+ * The cache is shared by all the threads that check volumes.  With the mmap
+ * engine the device is mapped once instead, and most blocks are read from
+ * there in place.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "block.h"
+#include "stats.h"
+#include "super.h"
+#include "uring.h"
+
+/*
+ * The block cache.  Blocks with no users are kept in a lru list, and the
+ * oldest of them get evicted once the memory budget is exceeded.  Blocks that
+ * are still in use are never evicted, so the budget can be overrun.
+ */
+static struct {
+	struct block	**c_hash;	/* Hash table of all cached blocks */
+	u64		c_hash_mask;	/* Number of hash buckets, minus one */
+	u64		c_count;	/* Number of blocks in the cache */
+	u64		c_max;		/* Number of blocks allowed by budget */
+	unsigned long	c_blocksize;	/* Size of the cached blocks */
+
+	struct block	*c_lru_head;	/* Least recently used block */
+	struct block	*c_lru_tail;	/* Most recently used block */
+
+	struct block	*c_free;	/* Pool of unused buffers, for reuse */
+	u64		c_free_count;	/* Number of buffers in the pool */
+
+	pthread_mutex_t	c_lock;		/* Protects all of the above */
+} cache = {
+	.c_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * The whole device mapped into memory, for the mmap engine.  Blocks inside the
+ * mapping are handed out directly and never enter the cache; any partial block
+ * at the end of the device is still read into the cache, to get the zeroes.
+ */
+static struct {
+	void		*m_base;	/* Start of the mapping, or NULL */
+	u64		m_blocks;	/* Number of whole blocks mapped */
+} map;
+
+/**
+ * alloc_io_buffer - Allocate a buffer that can be used for direct io
+ * @size: size of the buffer
+ */
+void *alloc_io_buffer(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, DIRECT_IO_ALIGN, size))
+		system_error();
+	return buf;
+}
+
+/**
+ * io_aligned - Check if a read can be done as it is with direct io
+ * @buf:	buffer to receive the data
+ * @count:	number of bytes to read
+ * @offset:	offset of the range on the device
+ */
+static inline bool io_aligned(void *buf, size_t count, off_t offset)
+{
+	if (!(options & OPT_DIRECT_IO))
+		return true;
+	return !(((unsigned long)buf | count | offset) & (DIRECT_IO_ALIGN - 1));
+}
+
+/**
+ * dev_read_bounce - Read an unaligned byte range from the device, for direct io
+ * @buf:	buffer to receive the data
+ * @count:	number of bytes to read
+ * @offset:	offset of the range on the device
+ */
+static void dev_read_bounce(void *buf, size_t count, off_t offset)
+{
+	off_t start = offset & ~(off_t)(DIRECT_IO_ALIGN - 1);
+	size_t len = offset - start + count;
+	void *bounce;
+
+	len = (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+	bounce = alloc_io_buffer(len);
+	dev_read(bounce, len, start);
+	memcpy(buf, bounce + (offset - start), count);
+	free(bounce);
+}
+
+/**
+ * dev_read - Read a byte range from the device
+ * @buf:	buffer to receive the data
+ * @count:	number of bytes to read
+ * @offset:	offset of the range on the device
+ *
+ * Anything that lies beyond the end of the device is read as zeroes, so it
+ * will be caught by the checks that follow.  With direct io, reads that are
+ * not aligned go through a bounce buffer.
+ */
+void dev_read(void *buf, size_t count, off_t offset)
+{
+	ssize_t read_bytes;
+
+	if (!io_aligned(buf, count, offset)) {
+		dev_read_bounce(buf, count, offset);
+		return;
+	}
+
+	while (count > 0) {
+		read_bytes = pread(fd, buf, count, offset);
+		if (read_bytes < 0)
+			system_error();
+		STATS_ADD(c_device_bytes, read_bytes);
+
+		/* With direct io, a partial block can only come at the end */
+		if (read_bytes == 0 || !io_aligned(NULL, read_bytes, 0)) {
+			memset(buf + read_bytes, 0, count - read_bytes);
+			return;
+		}
+		buf += read_bytes;
+		count -= read_bytes;
+		offset += read_bytes;
+	}
+}
+
+/**
+ * dev_readv - Read a byte range from the device into several buffers
+ * @iov:	array of buffers, will be modified
+ * @iovcnt:	number of buffers in @iov
+ * @offset:	offset of the range on the device
+ *
+ * As with dev_read(), anything beyond the end of the device is read as zeroes.
+ * With direct io, if any of the buffers is not aligned, the whole range is read
+ * into a bounce buffer first.
+ */
+void dev_readv(struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t read_bytes;
+	bool partial;
+	int i;
+
+	for (i = 0; i < iovcnt; ++i) {
+		if (!io_aligned(iov[i].iov_base, iov[i].iov_len, offset))
+			break;
+	}
+	if (i < iovcnt) {
+		size_t len = 0;
+		void *bounce;
+
+		for (i = 0; i < iovcnt; ++i)
+			len += iov[i].iov_len;
+		bounce = alloc_io_buffer(len);
+		dev_read(bounce, len, offset);
+		for (len = 0, i = 0; i < iovcnt; len += iov[i++].iov_len)
+			memcpy(iov[i].iov_base, bounce + len, iov[i].iov_len);
+		free(bounce);
+		return;
+	}
+
+	while (iovcnt > 0) {
+		read_bytes = preadv(fd, iov, iovcnt, offset);
+		if (read_bytes < 0)
+			system_error();
+		STATS_ADD(c_device_bytes, read_bytes);
+		if (read_bytes == 0)
+			break;
+		offset += read_bytes;
+
+		/* With direct io, a partial block can only come at the end */
+		partial = !io_aligned(NULL, read_bytes, 0);
+
+		/* Skip the buffers that got filled, and go on with the rest */
+		while (iovcnt > 0 && read_bytes >= iov->iov_len) {
+			read_bytes -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base += read_bytes;
+			iov->iov_len -= read_bytes;
+		}
+		if (partial)
+			break;
+	}
+
+	/* Whatever is left lies beyond the end of the device */
+	for (; iovcnt > 0; ++iov, --iovcnt)
+		memset(iov->iov_base, 0, iov->iov_len);
+}
+
+/**
+ * dev_read_batch - Read several byte ranges from the device
+ * @reqs:	array of read requests
+ * @count:	number of requests in @reqs
+ *
+ * With the io_uring engine, many of the reads can be in flight at the same
+ * time.  Otherwise they are done one by one with plain pread().
+ */
+void dev_read_batch(struct read_req *reqs, int count)
+{
+	int i;
+
+	if (io_engine == IO_ENGINE_URING) {
+		uring_read_batch(reqs, count);
+		return;
+	}
+	for (i = 0; i < count; ++i)
+		dev_read(reqs[i].r_buf, reqs[i].r_len, reqs[i].r_offset);
+}
+
+/**
+ * block_header - Find the cache header for a block handed out to a user
+ * @raw: pointer to the block data
+ */
+static inline struct block *block_header(void *raw)
+{
+	return raw + cache.c_blocksize;
+}
+
+/**
+ * block_data - Find the data for a cached block
+ * @block: the block header
+ */
+static inline void *block_data(struct block *block)
+{
+	return (void *)block - cache.c_blocksize;
+}
+
+/**
+ * hash_bno - Find the hash bucket for a block number
+ * @bno: the block number
+ */
+static inline struct block **hash_bno(u64 bno)
+{
+	return &cache.c_hash[bno & cache.c_hash_mask];
+}
+
+/**
+ * map_device - Map the whole device into memory for the mmap engine
+ *
+ * If the address space is too small for this, if direct io was requested, or
+ * if the mapping fails for some other reason, plain reads are used instead.
+ * The caller must hold the cache lock.
+ */
+static void map_device(void)
+{
+	off_t size;
+	void *base;
+
+	/* The mapping would go through the page cache */
+	if (sizeof(void *) < sizeof(u64) || options & OPT_DIRECT_IO)
+		goto fallback;
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0)
+		system_error();
+	if (size < cache.c_blocksize)
+		goto fallback;
+
+	base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		goto fallback;
+
+	/*
+	 * Catalog nodes are scattered all over the device, so don't read around
+	 * them.  This can't be set per tree: the advice applies to the whole vma,
+	 * so it would split the mapping.
+	 */
+	madvise(base, size, MADV_RANDOM);
+
+	map.m_blocks = size / cache.c_blocksize;
+	__atomic_store_n(&map.m_base, base, __ATOMIC_RELEASE);
+	return;
+
+fallback:
+	io_engine = IO_ENGINE_PREAD;
+}
+
+/**
+ * mapped_block - Find a block in the device mapping
+ * @bno: block number
+ *
+ * Returns a pointer to the block data, or NULL if it's not mapped.
+ */
+static inline void *mapped_block(u64 bno)
+{
+	void *base = __atomic_load_n(&map.m_base, __ATOMIC_ACQUIRE);
+
+	if (!base || bno >= map.m_blocks)
+		return NULL;
+	return base + bno * cache.c_blocksize;
+}
+
+/**
+ * init_block_cache - Set up the block cache on first use
+ *
+ * This is also where the io engine gets settled, falling back to plain reads
+ * if the requested one is not available.  The first block is always read
+ * before any other threads are started, so they never see @io_engine change.
+ */
+static void init_block_cache(void)
+{
+	u64 buckets = 1;
+
+	assert(sb->s_blocksize);
+	cache.c_blocksize = sb->s_blocksize;
+
+	cache.c_max = cache_size / (cache.c_blocksize + sizeof(struct block));
+	if (!cache.c_max)
+		cache.c_max = 1;
+	while (buckets < cache.c_max)
+		buckets <<= 1;
+
+	cache.c_hash = calloc(buckets, sizeof(*cache.c_hash));
+	if (!cache.c_hash)
+		system_error();
+	cache.c_hash_mask = buckets - 1;
+
+	if (io_engine == IO_ENGINE_URING &&
+	    !uring_init(queue_depth, cache.c_blocksize))
+		io_engine = IO_ENGINE_PREAD;
+	if (io_engine == IO_ENGINE_MMAP)
+		map_device();
+}
+
+/**
+ * lru_remove - Take a block out of the lru list
+ * @block: the block
+ */
+static void lru_remove(struct block *block)
+{
+	if (block->b_lru_prev)
+		block->b_lru_prev->b_lru_next = block->b_lru_next;
+	else
+		cache.c_lru_head = block->b_lru_next;
+	if (block->b_lru_next)
+		block->b_lru_next->b_lru_prev = block->b_lru_prev;
+	else
+		cache.c_lru_tail = block->b_lru_prev;
+	block->b_lru_prev = block->b_lru_next = NULL;
+}
+
+/**
+ * lru_add - Put a block at the most recently used end of the lru list
+ * @block: the block
+ */
+static void lru_add(struct block *block)
+{
+	block->b_lru_next = NULL;
+	block->b_lru_prev = cache.c_lru_tail;
+	if (cache.c_lru_tail)
+		cache.c_lru_tail->b_lru_next = block;
+	else
+		cache.c_lru_head = block;
+	cache.c_lru_tail = block;
+}
+
+/**
+ * free_block_locked - Give back the memory for a block that is not cached
+ * @raw: pointer to the block data, from alloc_block()
+ *
+ * The buffer is kept in the pool for reuse, unless the cache and the pool
+ * together would exceed the budget.  The caller must hold the cache lock.
+ */
+static void free_block_locked(void *raw)
+{
+	struct block *block = block_header(raw);
+
+	if (cache.c_count + cache.c_free_count >= cache.c_max) {
+		free(raw);
+		return;
+	}
+	block->b_hnext = cache.c_free;
+	cache.c_free = block;
+	++cache.c_free_count;
+}
+
+/**
+ * evict_blocks - Free unused blocks until the cache is within budget
+ * @room: number of new blocks that the cache must have room for
+ */
+static void evict_blocks(u64 room)
+{
+	while (cache.c_count + room > cache.c_max && cache.c_lru_head) {
+		struct block *block = cache.c_lru_head;
+		struct block **block_p = hash_bno(block->b_bno);
+
+		lru_remove(block);
+		while (*block_p != block)
+			block_p = &(*block_p)->b_hnext;
+		*block_p = block->b_hnext;
+
+		--cache.c_count;
+		free_block_locked(block_data(block));
+	}
+}
+
+/**
+ * find_cached_block - Look for a block in the cache, and take a reference
+ * @bno: block number
+ *
+ * Returns a pointer to the raw data of the block, or NULL if it's not cached.
+ * The caller must hold the cache lock.
+ */
+static void *find_cached_block(u64 bno)
+{
+	struct block *block;
+
+	for (block = *hash_bno(bno); block; block = block->b_hnext) {
+		if (block->b_bno != bno)
+			continue;
+		if (!block->b_refcnt++)
+			lru_remove(block);
+		return block_data(block);
+	}
+	return NULL;
+}
+
+/**
+ * alloc_block_locked - Get memory for a block and its cache header
+ *
+ * The buffer is taken from the pool if possible.  It's always aligned for
+ * direct io.  The caller must hold the cache lock.
+ */
+static void *alloc_block_locked(void)
+{
+	struct block *block = cache.c_free;
+
+	if (!block)
+		return alloc_io_buffer(cache.c_blocksize + sizeof(*block));
+	cache.c_free = block->b_hnext;
+	--cache.c_free_count;
+	return block_data(block);
+}
+
+/**
+ * alloc_block - Get memory for a block and its cache header
+ *
+ * The buffer must be given back with insert_block() or free_block_locked().
+ */
+static void *alloc_block(void)
+{
+	void *raw;
+
+	pthread_mutex_lock(&cache.c_lock);
+	raw = alloc_block_locked();
+	pthread_mutex_unlock(&cache.c_lock);
+	return raw;
+}
+
+/**
+ * insert_block - Add a block that was just read to the cache
+ * @raw:	the block data, from alloc_block()
+ * @bno:	block number
+ * @refcnt:	initial number of users for the block
+ *
+ * The caller must hold the cache lock, and must have checked that the block
+ * is not cached already.  Blocks with no users go to the end of the lru.
+ */
+static void insert_block(void *raw, u64 bno, int refcnt)
+{
+	struct block **bucket = hash_bno(bno);
+	struct block *block = block_header(raw);
+
+	evict_blocks(1);
+
+	block->b_bno = bno;
+	block->b_refcnt = refcnt;
+	block->b_lru_prev = block->b_lru_next = NULL;
+	block->b_hnext = *bucket;
+	*bucket = block;
+	++cache.c_count;
+	if (!refcnt)
+		lru_add(block);
+}
+
+/**
+ * read_block - Read a block from disk, or find it in the cache
+ * @bno: block number
+ *
+ * Returns a pointer to the raw data of the block in memory.  The caller must
+ * give it back with release_block() once it's done with it, and it must never
+ * write to it.
+ */
+void *read_block(u64 bno)
+{
+	void *raw, *cached;
+
+	raw = mapped_block(bno);
+	if (raw)
+		return raw;
+
+	pthread_mutex_lock(&cache.c_lock);
+	if (!cache.c_hash)
+		init_block_cache();
+	raw = mapped_block(bno);
+	if (!raw)
+		raw = find_cached_block(bno);
+	pthread_mutex_unlock(&cache.c_lock);
+	if (raw) {
+		STATS_ADD(c_cache_hits, 1);
+		return raw;
+	}
+	STATS_ADD(c_cache_misses, 1);
+
+	/* Don't hold the lock during the read, other threads may need it */
+	raw = alloc_block();
+	dev_read(raw, cache.c_blocksize, bno * cache.c_blocksize);
+
+	pthread_mutex_lock(&cache.c_lock);
+
+	/* Some other thread may have read the same block in the meantime */
+	cached = find_cached_block(bno);
+	if (cached) {
+		free_block_locked(raw);
+		pthread_mutex_unlock(&cache.c_lock);
+		return cached;
+	}
+
+	insert_block(raw, bno, 1 /* refcnt */);
+
+	pthread_mutex_unlock(&cache.c_lock);
+	return raw;
+}
+
+/**
+ * release_block_locked - Drop a reference to a cached block
+ * @raw: pointer to the raw data of the block
+ *
+ * The caller must hold the cache lock.
+ */
+static void release_block_locked(void *raw)
+{
+	struct block *block = block_header(raw);
+
+	assert(block->b_refcnt > 0);
+	if (!--block->b_refcnt) {
+		lru_add(block);
+		evict_blocks(0);
+	}
+}
+
+/**
+ * release_block - Give back a block returned by read_block()
+ * @raw: pointer to the raw data of the block
+ */
+void release_block(void *raw)
+{
+	void *base = __atomic_load_n(&map.m_base, __ATOMIC_ACQUIRE);
+
+	if (!raw)
+		return;
+	if (base && raw >= base && raw < base + map.m_blocks * cache.c_blocksize)
+		return;
+
+	pthread_mutex_lock(&cache.c_lock);
+	release_block_locked(raw);
+	pthread_mutex_unlock(&cache.c_lock);
+}
+
+/**
+ * compare_bnos - Compare two block numbers, for qsort()
+ * @a: pointer to the first block number
+ * @b: pointer to the second block number
+ */
+static int compare_bnos(const void *a, const void *b)
+{
+	u64 bno1 = *(u64 *)a;
+	u64 bno2 = *(u64 *)b;
+
+	if (bno1 < bno2)
+		return -1;
+	return bno1 > bno2;
+}
+
+/**
+ * read_into_cache - Read a batch of blocks into the cache, with no users
+ * @bnos:	array of block numbers, not cached when last checked
+ * @count:	number of blocks in @bnos
+ */
+static void read_into_cache(u64 *bnos, int count)
+{
+	struct read_req *reqs;
+	int i;
+
+	/* Don't let the batch push out blocks that are still needed */
+	if (count > cache.c_max / 2)
+		count = cache.c_max / 2;
+	if (!count)
+		return;
+
+	reqs = calloc(count, sizeof(*reqs));
+	if (!reqs)
+		system_error();
+	for (i = 0; i < count; ++i) {
+		reqs[i].r_buf = alloc_block();
+		reqs[i].r_len = cache.c_blocksize;
+		reqs[i].r_offset = bnos[i] * cache.c_blocksize;
+	}
+
+	dev_read_batch(reqs, count);
+
+	pthread_mutex_lock(&cache.c_lock);
+	for (i = 0; i < count; ++i) {
+		void *cached = find_cached_block(bnos[i]);
+
+		/* Some other thread may have read the block in the meantime */
+		if (cached) {
+			release_block_locked(cached);
+			free_block_locked(reqs[i].r_buf);
+			continue;
+		}
+		insert_block(reqs[i].r_buf, bnos[i], 0 /* refcnt */);
+	}
+	pthread_mutex_unlock(&cache.c_lock);
+	free(reqs);
+}
+
+/**
+ * drop_cached_blocks - Sort a list of blocks and keep the ones not yet cached
+ * @bnos:	array of block numbers, will be sorted
+ * @count:	number of blocks in @bnos
+ *
+ * Duplicates are dropped as well.  Returns the number of blocks left at the
+ * start of @bnos.
+ */
+static int drop_cached_blocks(u64 *bnos, int count)
+{
+	int needed = 0;
+	int i;
+
+	qsort(bnos, count, sizeof(*bnos), compare_bnos);
+
+	pthread_mutex_lock(&cache.c_lock);
+	if (!cache.c_hash)
+		init_block_cache();
+	for (i = 0; i < count; ++i) {
+		struct block *block;
+
+		for (block = *hash_bno(bnos[i]); block; block = block->b_hnext) {
+			if (block->b_bno == bnos[i])
+				break;
+		}
+		if (block)
+			continue;
+		if (needed && bnos[needed - 1] == bnos[i])
+			continue;
+		bnos[needed++] = bnos[i];
+	}
+	pthread_mutex_unlock(&cache.c_lock);
+	return needed;
+}
+
+/**
+ * advise_range - Hint that a run of consecutive blocks will be needed soon
+ * @start:	first block of the run
+ * @len:	number of blocks in the run
+ */
+static void advise_range(u64 start, u64 len)
+{
+	void *raw = mapped_block(start);
+	unsigned long pagesize;
+	void *addr;
+
+	/* Readahead would fill the page cache, which direct io is meant to skip */
+	if (options & OPT_DIRECT_IO)
+		return;
+
+	if (!raw || start + len > map.m_blocks) {
+		posix_fadvise(fd, start * cache.c_blocksize,
+			      len * cache.c_blocksize, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	/* madvise() wants page alignment, in case blocks are smaller */
+	pagesize = sysconf(_SC_PAGESIZE);
+	addr = (void *)((unsigned long)raw & ~(pagesize - 1));
+	madvise(addr, raw - addr + len * cache.c_blocksize, MADV_WILLNEED);
+}
+
+/**
+ * advise_blocks - Hint that a sorted list of blocks will be needed soon
+ * @bnos:	array of block numbers, in ascending order
+ * @count:	number of blocks in @bnos
+ *
+ * The blocks are grouped into runs of consecutive blocks, and each run gets a
+ * single hint.
+ */
+static void advise_blocks(u64 *bnos, int count)
+{
+	u64 start = 0, len = 0;
+	int i;
+
+	for (i = 0; i <= count; ++i) {
+		if (i < count && len && bnos[i] <= start + len) {
+			len = bnos[i] - start + 1;
+			continue;
+		}
+		if (len)
+			advise_range(start, len);
+		if (i < count) {
+			start = bnos[i];
+			len = 1;
+		}
+	}
+}
+
+/**
+ * prefetch_blocks - Let the device know that some blocks will be needed soon
+ * @bnos:	array of block numbers, will be sorted
+ * @count:	number of blocks in @bnos
+ *
+ * The blocks must still be read with read_block() afterwards.  Blocks that are
+ * already cached are skipped.  With the uring engine, the rest are just read
+ * into the cache, since many reads can be in flight; the other engines only
+ * give the kernel a readahead hint.
+ */
+void prefetch_blocks(u64 *bnos, int count)
+{
+	int needed;
+
+	needed = drop_cached_blocks(bnos, count);
+
+	if (io_engine == IO_ENGINE_URING) {
+		read_into_cache(bnos, needed);
+		return;
+	}
+	advise_blocks(bnos, needed);
+}
+
+/**
+ * sweep_blocks - Read a list of blocks into the cache in ascending order
+ * @bnos:	array of block numbers, will be sorted
+ * @count:	number of blocks in @bnos
+ *
+ * Meant for reading whole trees ahead of time, so that the device only has to
+ * move forward.  Runs of consecutive blocks are read with a single request.
+ * As with prefetch_blocks(), no more than half the cache gets filled, so the
+ * blocks past that point will just be read on demand.  With the mmap engine
+ * the blocks are not copied anywhere, so the kernel is just asked to read
+ * them all ahead.
+ */
+void sweep_blocks(u64 *bnos, int count)
+{
+	struct read_req *reqs;
+	int needed, run_count = 0;
+	int i, j;
+
+	needed = drop_cached_blocks(bnos, count);
+	if (__atomic_load_n(&map.m_base, __ATOMIC_ACQUIRE)) {
+		advise_blocks(bnos, needed);
+		return;
+	}
+	if (needed > cache.c_max / 2)
+		needed = cache.c_max / 2;
+	if (!needed)
+		return;
+
+	reqs = calloc(needed, sizeof(*reqs));
+	if (!reqs)
+		system_error();
+	for (i = 0; i < needed; i = j) {
+		for (j = i + 1; j < needed && j - i < SWEEP_MAX_RUN; ++j) {
+			if (bnos[j] != bnos[j - 1] + 1)
+				break;
+		}
+		reqs[run_count].r_len = (j - i) * cache.c_blocksize;
+		reqs[run_count].r_offset = bnos[i] * cache.c_blocksize;
+		reqs[run_count].r_buf = alloc_io_buffer(reqs[run_count].r_len);
+		++run_count;
+	}
+
+	dev_read_batch(reqs, run_count);
+
+	pthread_mutex_lock(&cache.c_lock);
+	for (i = 0, j = 0; i < run_count; ++i) {
+		size_t off;
+
+		for (off = 0; off < reqs[i].r_len; off += cache.c_blocksize) {
+			u64 bno = bnos[j++];
+			void *raw;
+
+			/* Some other thread may have read the block already */
+			raw = find_cached_block(bno);
+			if (raw) {
+				release_block_locked(raw);
+				continue;
+			}
+			raw = alloc_block_locked();
+			memcpy(raw, reqs[i].r_buf + off, cache.c_blocksize);
+			insert_block(raw, bno, 0 /* refcnt */);
+		}
+		free(reqs[i].r_buf);
+	}
+	pthread_mutex_unlock(&cache.c_lock);
+	free(reqs);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _BLOCK_H
+#define _BLOCK_H
+
+#include <sys/types.h>
+#include <apfs/types.h>
+
+struct iovec;
+
+/* Default memory budget for the block cache, in MiB */
+#define BLOCK_CACHE_DEFAULT_MB	64
+
+/* Engines for reading from the device */
+#define IO_ENGINE_PREAD		0	/* One synchronous read at a time */
+#define IO_ENGINE_URING		1	/* Batches of reads through io_uring */
+#define IO_ENGINE_MMAP		2	/* Whole device mapped into memory */
+
+/* Default number of reads in flight for the engines that allow several */
+#define IO_DEFAULT_QUEUE_DEPTH	32
+
+/* Alignment of buffers, offsets and lengths for direct io */
+#define DIRECT_IO_ALIGN		4096
+
+/* Maximum number of blocks in a single request of a sweep */
+#define SWEEP_MAX_RUN		256
+
+/*
+ * A single read for the batched interface.
+ */
+struct read_req {
+	void	*r_buf;		/* Buffer to receive the data */
+	size_t	r_len;		/* Number of bytes to read */
+	off_t	r_offset;	/* Offset of the data on the device */
+};
+
+/*
+ * In-memory header for a cached block.  It is placed right after the block
+ * data, in the same allocation, so that it can be found from the pointer
+ * handed out to the callers.
+ */
+struct block {
+	u64		b_bno;		/* Block number */
+	int		b_refcnt;	/* Number of users of the block */
+
+	struct block	*b_hnext;	/* Next block in the hash chain */
+	struct block	*b_lru_prev;	/* Previous unused block in the lru */
+	struct block	*b_lru_next;	/* Next unused block in the lru */
+};
+
+extern void *alloc_io_buffer(size_t size);
+extern void dev_read(void *buf, size_t count, off_t offset);
+extern void dev_readv(struct iovec *iov, int iovcnt, off_t offset);
+extern void dev_read_batch(struct read_req *reqs, int count);
+extern void *read_block(u64 bno);
+extern void release_block(void *raw);
+extern void prefetch_blocks(u64 *bnos, int count);
+extern void sweep_blocks(u64 *bnos, int count);
+
+#endif	/* _BLOCK_H */
@@ -3,13 +3,14 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include "apfsck.h"
+#include "block.h"
 #include "btree.h"
 #include "dir.h"
 #include "extents.h"
@@ -21,8 +22,6 @@
 #include "super.h"
 #include "xattr.h"
 
-bool ongoing_query;
-
 /**
  * node_min_table_size - Return the minimum size for a node's table of contents
  * @node: the node
@@ -91,6 +90,64 @@ static bool node_is_valid(struct node *node)
 	return records * entry_size <= index_size;
 }
 
+/**
+ * alloc_node_bmap - Allocate a bitmap for the space in a node area
+ * @area_len:	length of the area, in bytes
+ * @full:	should all bits start set?
+ *
+ * Each bit represents a byte in the area.  The bitmap is made of whole words,
+ * so it can be handled one word at a time.
+ */
+static u64 *alloc_node_bmap(int area_len, bool full)
+{
+	int size = DIV_ROUND_UP(area_len, 64) * sizeof(u64);
+	u64 *bmap;
+
+	bmap = malloc(size);
+	if (!bmap)
+		system_error();
+	memset(bmap, full ? 0xFF : 0x00, size);
+	return bmap;
+}
+
+/**
+ * node_bmap_flip - Set or clear a range of bits in a node area bitmap
+ * @bitmap:	the bitmap
+ * @off:	first bit of the range
+ * @len:	number of bits in the range
+ * @set:	set the bits? Otherwise they are cleared
+ *
+ * Returns true if all the bits in the range were flipped, false if some of
+ * them already had the requested value.
+ */
+static bool node_bmap_flip(u64 *bitmap, int off, int len, bool set)
+{
+	u64 conflicts = 0;
+	int last = off + len - 1;
+	int i;
+
+	if (len <= 0)
+		return true;
+
+	for (i = off / 64; i <= last / 64; ++i) {
+		u64 mask = ~0ULL;
+
+		if (i == off / 64)
+			mask &= ~0ULL << (off % 64);
+		if (i == last / 64)
+			mask &= ~0ULL >> (63 - last % 64);
+
+		if (set) {
+			conflicts |= bitmap[i] & mask;
+			bitmap[i] |= mask;
+		} else {
+			conflicts |= ~bitmap[i] & mask;
+			bitmap[i] &= ~mask;
+		}
+	}
+	return !conflicts;
+}
+
 /**
  * node_parse_key_free_list - Parse a node's free key list into a bitmap
  * @node: the node to parse
@@ -105,15 +162,11 @@ static void node_parse_key_free_list(struct node *node)
 	int total = le16_to_cpu(free->len);
 	int off;
 
-	/* Each bit represents a byte in the key area */
-	node->free_key_bmap = malloc((area_len + 7) / 8);
-	if (!node->free_key_bmap)
-		system_error();
-	memset(node->free_key_bmap, 0xFF, (area_len + 7) / 8);
+	node->free_key_bmap = alloc_node_bmap(area_len, true /* full */);
 
 	off = le16_to_cpu(free->off);
 	while (total > 0) {
-		int len, i;
+		int len;
 
 		/* Tiny free areas may not be in the list */
 		if (off == APFS_BTOFF_INVALID)
@@ -131,15 +184,10 @@ static void node_parse_key_free_list(struct node *node)
 		if (off + len > area_len)
 			report("B-tree node", "free key is out-of-bounds.");
 
-		for (i = off; i < off + len; ++i) {
-			u8 *byte = node->free_key_bmap + i / 8;
-			u8 flag = 1 << i % 8;
-
-			if (!(*byte & flag))
-				report("B-tree node",
-				       "byte listed twice in free key list.");
-			*byte ^= flag;
-		}
+		if (!node_bmap_flip(node->free_key_bmap, off, len,
+				    false /* set */))
+			report("B-tree node",
+			       "byte listed twice in free key list.");
 		total -= len;
 
 		off = le16_to_cpu(free->off);
@@ -168,15 +216,11 @@ static void node_parse_val_free_list(struct node *node)
 		   (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
 	end_raw = (void *)node->raw + node->data + area_len;
 
-	/* Each bit represents a byte in the value area */
-	node->free_val_bmap = malloc((area_len + 7) / 8);
-	if (!node->free_val_bmap)
-		system_error();
-	memset(node->free_val_bmap, 0xFF, (area_len + 7) / 8);
+	node->free_val_bmap = alloc_node_bmap(area_len, true /* full */);
 
 	off = le16_to_cpu(free->off);
 	while (total > 0) {
-		int len, i;
+		int len;
 
 		/* Tiny free areas may not be in the list */
 		if (off == APFS_BTOFF_INVALID)
@@ -194,15 +238,10 @@ static void node_parse_val_free_list(struct node *node)
 		if (area_len < off || len > off)
 			report("B-tree node", "free value is out-of-bounds.");
 
-		for (i = area_len - off; i < area_len - off + len; ++i) {
-			u8 *byte = node->free_val_bmap + i / 8;
-			u8 flag = 1 << i % 8;
-
-			if (!(*byte & flag))
-				report("B-tree node",
-				       "byte listed twice in free value list.");
-			*byte ^= flag;
-		}
+		if (!node_bmap_flip(node->free_val_bmap, area_len - off, len,
+				    false /* set */))
+			report("B-tree node",
+			       "byte listed twice in free value list.");
 		total -= len;
 
 		off = le16_to_cpu(free->off);
@@ -234,24 +273,115 @@ static void node_prepare_bitmaps(struct node *node)
 
 	keys_len = node->free - node->key;
 
-	/* Each bit represents a byte in the key area */
-	node->used_key_bmap = calloc(1, (keys_len + 7) / 8);
-	if (!node->used_key_bmap)
-		system_error();
+	node->used_key_bmap = alloc_node_bmap(keys_len, false /* full */);
 
 	/* Only the root has a footer */
 	values_len = sb->s_blocksize - node->data -
 		     (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
 
-	/* Each bit represents a byte in the value area */
-	node->used_val_bmap = calloc(1, (values_len + 7) / 8);
-	if (!node->used_val_bmap)
-		system_error();
+	node->used_val_bmap = alloc_node_bmap(values_len, false /* full */);
 
 	node_parse_key_free_list(node);
 	node_parse_val_free_list(node);
 }
 
+/*
+ * Node that already had its space checked, maybe for an older checkpoint.
+ * Consecutive checkpoints share most of their nodes, so this saves building
+ * and comparing the bitmaps again for each of them.
+ */
+struct verified_node {
+	struct htable_entry	n_htable;	/* Hash table entry header */
+	u64			n_xid;		/* Transaction id for the node */
+	u64			n_cksum;	/* Checksum for the node */
+};
+#define n_bno	n_htable.h_id			/* Block number for the node */
+
+/* Nodes checked so far, shared by all checkpoints and all threads */
+static struct {
+	struct arena		*v_arena;	/* Memory for the entries */
+	struct htable		*v_table;	/* Hash table of the entries */
+	pthread_mutex_t		v_lock;		/* Lock for the hash table */
+} verified_nodes = {
+	.v_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * node_is_verified - Check if an identical node had its space checked before
+ * @node: the node, with its object header already read
+ */
+static bool node_is_verified(struct node *node)
+{
+	struct verified_node *entry = NULL;
+	u64 cksum = le64_to_cpu(node->raw->btn_o.o_cksum);
+	bool ret;
+
+	pthread_mutex_lock(&verified_nodes.v_lock);
+	if (verified_nodes.v_table)
+		entry = (struct verified_node *)find_htable_entry(
+				node->object.block_nr, verified_nodes.v_table);
+	ret = entry && entry->n_xid == node->object.xid &&
+	      entry->n_cksum == cksum;
+	pthread_mutex_unlock(&verified_nodes.v_lock);
+	return ret;
+}
+
+/**
+ * node_set_verified - Remember that the space of a node was checked
+ * @node: the node
+ *
+ * There is nothing to gain from this in the last checkpoint, so nodes are only
+ * remembered for the older ones.
+ */
+static void node_set_verified(struct node *node)
+{
+	struct verified_node *entry;
+
+	if (sb->s_last_cpoint)
+		return;
+
+	pthread_mutex_lock(&verified_nodes.v_lock);
+	if (!verified_nodes.v_table) {
+		verified_nodes.v_arena = alloc_arena();
+		verified_nodes.v_table = alloc_htable(verified_nodes.v_arena);
+	}
+	entry = (struct verified_node *)get_htable_entry(node->object.block_nr,
+				sizeof(*entry), verified_nodes.v_table);
+	entry->n_xid = node->object.xid;
+	entry->n_cksum = le64_to_cpu(node->raw->btn_o.o_cksum);
+	pthread_mutex_unlock(&verified_nodes.v_lock);
+}
+
+/**
+ * free_verified_nodes - Forget all the nodes that had their space checked
+ */
+void free_verified_nodes(void)
+{
+	if (!verified_nodes.v_table)
+		return;
+	free_htable(verified_nodes.v_table, NULL /* free_entry */);
+	verified_nodes.v_table = NULL;
+	free_arena(verified_nodes.v_arena);
+	verified_nodes.v_arena = NULL;
+}
+
+/**
+ * node_parse_header - Fill the fields of a node structure from its header
+ * @node: the node, with the raw block already set
+ */
+static void node_parse_header(struct node *node)
+{
+	struct apfs_btree_node_phys *raw = node->raw;
+
+	node->level = le16_to_cpu(raw->btn_level);
+	node->flags = le16_to_cpu(raw->btn_flags);
+	node->records = le32_to_cpu(raw->btn_nkeys);
+	node->toc = sizeof(*raw) + le16_to_cpu(raw->btn_table_space.off);
+	node->key = node->toc + le16_to_cpu(raw->btn_table_space.len);
+	node->free = node->key + le16_to_cpu(raw->btn_free_space.off);
+	node->data = node->free + le16_to_cpu(raw->btn_free_space.len);
+}
+
 /**
  * read_node - Read a node header from disk
  * @oid:	object id for the node
@@ -276,14 +406,7 @@ static struct node *read_node(u64 oid, struct btree *btree)
 	else
 		raw = read_object(oid, btree->omap_table, &node->object);
 	node->raw = raw;
-
-	node->level = le16_to_cpu(raw->btn_level);
-	node->flags = le16_to_cpu(raw->btn_flags);
-	node->records = le32_to_cpu(raw->btn_nkeys);
-	node->toc = sizeof(*raw) + le16_to_cpu(raw->btn_table_space.off);
-	node->key = node->toc + le16_to_cpu(raw->btn_table_space.len);
-	node->free = node->key + le16_to_cpu(raw->btn_free_space.off);
-	node->data = node->free + le16_to_cpu(raw->btn_free_space.len);
+	node_parse_header(node);
 
 	if (!node_is_valid(node)) {
 		report("B-tree node", "block 0x%llx is not sane.",
@@ -311,7 +434,10 @@ static struct node *read_node(u64 oid, struct btree *btree)
 					 APFS_OBJECT_TYPE_SPACEMAN_FREE_QUEUE)
 		report("Free queue node", "wrong object subtype.");
 
-	node_prepare_bitmaps(node);
+	/* The space checks only depend on the contents of the block */
+	node->verified = node_is_verified(node);
+	if (!node->verified)
+		node_prepare_bitmaps(node);
 
 	return node;
 }
@@ -327,7 +453,7 @@ static void node_free(struct node *node)
 {
 	if (node_is_root(node))
 		return;	/* The root nodes are needed by the sb until the end */
-	munmap(node->raw, sb->s_blocksize);
+	release_block(node->raw);
 	free(node->free_key_bmap);
 	free(node->free_val_bmap);
 	free(node->used_key_bmap);
@@ -335,6 +461,39 @@ static void node_free(struct node *node)
 	free(node);
 }
 
+/**
+ * node_defer - Set a leaf aside, so that its records can be parsed later
+ * @node: the leaf, already checked
+ *
+ * The free space bitmaps are no longer needed at this point, so they go away
+ * right now to save memory.  The block is released as well, so that a large
+ * subtree can't pin more blocks than the cache allows; it will be read again
+ * when the records get parsed, often still from the cache.
+ */
+static void node_defer(struct node *node)
+{
+	struct btree *btree = node->btree;
+	int count = btree->deferred_count;
+
+	free(node->free_key_bmap);
+	free(node->free_val_bmap);
+	free(node->used_key_bmap);
+	free(node->used_val_bmap);
+	node->free_key_bmap = node->free_val_bmap = NULL;
+	node->used_key_bmap = node->used_val_bmap = NULL;
+	release_block(node->raw);
+	node->raw = NULL;
+
+	/* Double the size of the array each time it gets full */
+	if (!(count & (count - 1))) {
+		btree->deferred = realloc(btree->deferred, (count ? 2 * count : 1) *
+						sizeof(*btree->deferred));
+		if (!btree->deferred)
+			system_error();
+	}
+	btree->deferred[btree->deferred_count++] = node;
+}
+
 /**
  * node_locate_key - Locate the key of a node record
  * @node:	node to be searched
@@ -378,23 +537,18 @@ static int node_locate_key(struct node *node, int index, int *off)
 }
 
 /**
- * node_locate_data - Locate the data of a node record
+ * node_find_data - Locate the data of a node record, without reporting issues
  * @node:	node to be searched
- * @index:	number of the entry to locate
+ * @index:	number of the entry to locate, must be in range
  * @off:	on return will hold the offset in the block
  *
- * Returns the length of the data. The function checks that this length fits
- * within the value area; callers must use the returned value to make sure they
- * never operate outside its bounds.
+ * Returns the length of the data, or -1 if the offset is out-of-bounds.
  */
-static int node_locate_data(struct node *node, int index, int *off)
+static int node_find_data(struct node *node, int index, int *off)
 {
 	struct apfs_btree_node_phys *raw;
 	int len, off_in_area, area_len;
 
-	if (index >= node->records)
-		report("B-tree", "requested index out-of-bounds.");
-
 	/* Only the root has a footer */
 	area_len = sb->s_blocksize - node->data -
 		   (node_is_root(node) ? sizeof(struct apfs_btree_info) : 0);
@@ -431,8 +585,30 @@ static int node_locate_data(struct node *node, int index, int *off)
 
 	*off = node->data + off_in_area;
 	if (*off < node->data || off_in_area >= area_len)
-		report("B-tree", "value is out-of-bounds.");
+		return -1;
+	return len;
+}
+
+/**
+ * node_locate_data - Locate the data of a node record
+ * @node:	node to be searched
+ * @index:	number of the entry to locate
+ * @off:	on return will hold the offset in the block
+ *
+ * Returns the length of the data. The function checks that this length fits
+ * within the value area; callers must use the returned value to make sure they
+ * never operate outside its bounds.
+ */
+static int node_locate_data(struct node *node, int index, int *off)
+{
+	int len;
+
+	if (index >= node->records)
+		report("B-tree", "requested index out-of-bounds.");
 
+	len = node_find_data(node, index, off);
+	if (len < 0)
+		report("B-tree", "value is out-of-bounds.");
 	return len;
 }
 
@@ -442,20 +618,10 @@ static int node_locate_data(struct node *node, int index, int *off)
  * @off:	offset of the region, relative to its area in the node
  * @len:	length of the region in the node
  */
-static void bmap_mark_as_used(u8 *bitmap, int off, int len)
+static void bmap_mark_as_used(u64 *bitmap, int off, int len)
 {
-	u8 *byte;
-	u8 flag;
-	int i;
-
-	for (i = off; i < off + len; ++i) {
-		byte = bitmap + i / 8;
-		flag = 1 << i % 8;
-
-		if (*byte & flag)
-			report("B-tree node", "overlapping record data.");
-		*byte |= flag;
-	}
+	if (!node_bmap_flip(bitmap, off, len, true /* set */))
+		report("B-tree node", "overlapping record data.");
 }
 
 /**
@@ -468,32 +634,20 @@ static void bmap_mark_as_used(u8 *bitmap, int off, int len)
  * total number of free bytes (including those not counted in @free_bmap due
  * to fragmentation).
  */
-static int compare_bmaps(u8 *free_bmap, u8 *used_bmap, int area_len)
+static int compare_bmaps(u64 *free_bmap, u64 *used_bmap, int area_len)
 {
 	int unused = 0;
-	int i, j;
-
-	for (i = 0; i < area_len / 8; ++i) {
-		for (j = 0; j < 8; ++j) {
-			u8 mask = 1 << j;
-
-			if (!(used_bmap[i] & mask))
-				++unused;
-		}
+	int i;
 
-		if ((free_bmap[i] | used_bmap[i]) != free_bmap[i])
-			report("B-tree node",
-			       "used record space listed as free.");
-	}
+	for (i = 0; i < DIV_ROUND_UP(area_len, 64); ++i) {
+		u64 mask = ~0ULL;
 
-	/* Last byte has some undefined bits by the end, so be careful */
-	for (j = 0; j < area_len % 8; ++j) {
-		u8 mask = 1 << j;
+		/* Last word has some undefined bits by the end, so be careful */
+		if (i == area_len / 64)
+			mask >>= 64 - area_len % 64;
 
-		if (!(used_bmap[area_len / 8] & mask))
-			++unused;
-		if (used_bmap[area_len / 8] & mask &&
-		    !(free_bmap[area_len / 8] & mask))
+		unused += __builtin_popcountll(~used_bmap[i] & mask);
+		if (used_bmap[i] & ~free_bmap[i] & mask)
 			report("B-tree node",
 			       "used record space listed as free.");
 	}
@@ -590,15 +744,13 @@ static void free_omap_record(struct htable_entry *entry)
 
 	if (!omap_rec->o_seen)
 		report("Omap record", "object id is never used.");
-
-	free(entry);
 }
 
 /**
  * free_omap_table - Free a hash table for omap records, and all its entries
  * @table: table to free
  */
-void free_omap_table(struct htable_entry **table)
+void free_omap_table(struct htable *table)
 {
 	free_htable(table, free_omap_record);
 }
@@ -610,7 +762,7 @@ void free_omap_table(struct htable_entry **table)
  *
  * Returns the omap record structure, after creating it if necessary.
  */
-struct omap_record *get_omap_record(u64 oid, struct htable_entry **table)
+struct omap_record *get_omap_record(u64 oid, struct htable *table)
 {
 	struct htable_entry *entry;
 
@@ -674,6 +826,225 @@ static void parse_omap_record(struct apfs_omap_key *key,
 		report_unknown("Objects with more than one block");
 }
 
+/**
+ * node_prefetch_children - Request all the children of an index node at once
+ * @node: the index node
+ *
+ * The child blocks are then read one by one, as the subtree is parsed, so
+ * they should have arrived by then.  Nothing is checked here: that will also
+ * happen later, so any values that make no sense are just skipped.
+ */
+static void node_prefetch_children(struct node *node)
+{
+	struct btree *btree = node->btree;
+	u64 *bnos;
+	int count = 0;
+	int i;
+
+	/* The free-space queue is tiny, and its nodes are ephemeral anyway */
+	if (node_is_leaf(node) || btree_is_free_queue(btree))
+		return;
+	if (!node->records)
+		return;
+
+	bnos = malloc(node->records * sizeof(*bnos));
+	if (!bnos)
+		system_error();
+
+	for (i = 0; i < node->records; ++i) {
+		u64 child_id;
+		int off;
+
+		if (node_find_data(node, i, &off) != 8 ||
+		    off + 8 > sb->s_blocksize)
+			continue;
+		child_id = le64_to_cpu(*(__le64 *)((void *)node->raw + off));
+
+		if (btree->omap_table) {
+			struct omap_record *omap_rec;
+
+			/* Don't create records here, they may not exist */
+			omap_rec = (struct omap_record *)find_htable_entry(
+						child_id, btree->omap_table);
+			if (!omap_rec || !omap_rec->o_bno)
+				continue;
+			child_id = omap_rec->o_bno;
+		}
+		bnos[count++] = child_id;
+	}
+
+	prefetch_blocks(bnos, count);
+	free(bnos);
+}
+
+/**
+ * sweep_virtual_tree - Read all the nodes of a virtual tree in physical order
+ * @omap_table: object map for the tree
+ *
+ * Every block mapped by the object map is read into the cache, in a single
+ * forward pass over the device, so that the tree can later be checked from
+ * memory.  The map may also cover objects that are not part of the tree, but
+ * that doesn't matter here.
+ */
+static void sweep_virtual_tree(struct htable *omap_table)
+{
+	u64 *bnos;
+	u64 i;
+	int count = 0;
+
+	if (!omap_table->t_count)
+		return;
+	bnos = malloc(omap_table->t_count * sizeof(*bnos));
+	if (!bnos)
+		system_error();
+
+	for (i = 0; i <= omap_table->t_mask; ++i) {
+		struct omap_record *omap_rec;
+
+		omap_rec = (struct omap_record *)omap_table->t_slots[i].s_entry;
+		if (omap_rec && omap_rec->o_bno)
+			bnos[count++] = omap_rec->o_bno;
+	}
+
+	sweep_blocks(bnos, count);
+	free(bnos);
+}
+
+/**
+ * sweep_physical_tree - Read all the nodes of a physical tree in level order
+ * @btree:	the tree
+ * @bno:	block number for the root
+ *
+ * There is no map of the whole tree for physical objects, so this goes down
+ * one level at a time: the nodes of each level are read in a single forward
+ * pass, and their children make up the next level.  Nothing is checked here,
+ * so nodes that make no sense are just skipped; the sweep also stops early if
+ * the tree gets too big for the cache.
+ */
+static void sweep_physical_tree(struct btree *btree, u64 bno)
+{
+	u64 *level, *scratch;
+	int count = 1, depth, max_depth = 0;
+	u64 budget = cache_size / sb->s_blocksize / 2;
+	u64 total = 0;
+
+	level = malloc(sizeof(*level));
+	if (!level)
+		system_error();
+	level[0] = bno;
+
+	for (depth = 0; count && depth <= max_depth; ++depth) {
+		u64 *next = NULL;
+		int next_count = 0;
+		int i;
+
+		total += count;
+		if (total > budget)
+			break;
+
+		/* Sweeping sorts the array and drops the cached blocks */
+		scratch = malloc(count * sizeof(*scratch));
+		if (!scratch)
+			system_error();
+		memcpy(scratch, level, count * sizeof(*scratch));
+		sweep_blocks(scratch, count);
+		free(scratch);
+
+		for (i = 0; i < count; ++i) {
+			struct node node = {0};
+			int j;
+
+			node.btree = btree;
+			node.raw = read_block(level[i]);
+			node_parse_header(&node);
+
+			/* The depth of the tree is only known after the root */
+			if (depth == 0)
+				max_depth = node.level;
+
+			if (!node_is_valid(&node) || node_is_leaf(&node) ||
+			    node_has_fixed_kv_size(&node) || !node.records) {
+				release_block(node.raw);
+				continue;
+			}
+
+			next = realloc(next, (next_count + node.records) *
+					     sizeof(*next));
+			if (!next)
+				system_error();
+			for (j = 0; j < node.records; ++j) {
+				int off;
+
+				if (node_find_data(&node, j, &off) != 8 ||
+				    off + 8 > sb->s_blocksize)
+					continue;
+				next[next_count++] = le64_to_cpu(
+					*(__le64 *)((void *)node.raw + off));
+			}
+			release_block(node.raw);
+		}
+
+		free(level);
+		level = next;
+		count = next_count;
+	}
+	free(level);
+}
+
+/* Number of catalog subtrees that each thread may check ahead of time */
+#define CAT_QUEUE_WINDOW_PER_JOB	2
+
+/*
+ * Subtree under the root of the catalog.  It gets checked by whichever thread
+ * claims it first, but its records are parsed later, in key order, by the
+ * thread that owns the volume.
+ */
+struct cat_subtree {
+	u64		s_child_id;	/* Object id for the root of the subtree */
+	struct key	s_first_key;	/* Index key for the subtree */
+	struct key	s_last_key;	/* Last key in the subtree */
+	char		s_name_buf[256]; /* Name for @s_last_key */
+	struct btree	s_btree;	/* Stats and leaves for the subtree */
+	bool		s_done;		/* Has the subtree been checked? */
+};
+
+/*
+ * Queue of catalog subtrees to be checked.  They are claimed in order, but no
+ * further ahead of the parsed records than the window allows, to put a limit
+ * on the number of leaves set aside.
+ */
+struct cat_queue {
+	struct btree		*q_btree;	/* The catalog */
+	struct volume_superblock *q_vsb;	/* Volume for the catalog */
+	struct cat_subtree	*q_subtrees;	/* Array of subtrees */
+	int			q_count;	/* Number of subtrees */
+	int			q_next;		/* Next subtree to claim */
+	int			q_parsed;	/* Subtrees with records parsed */
+	int			q_window;	/* Subtrees claimed ahead, at most */
+	pthread_mutex_t		q_lock;		/* Lock for the fields above */
+	pthread_cond_t		q_cond;		/* Signals progress */
+};
+
+/**
+ * queue_cat_subtree - Add a subtree of the catalog root to the queue
+ * @queue:	the queue
+ * @child_id:	object id for the root of the subtree
+ * @key:	index key for the subtree, already checked
+ */
+static void queue_cat_subtree(struct cat_queue *queue, u64 child_id,
+			      struct key *key)
+{
+	struct cat_subtree *subtree = &queue->q_subtrees[queue->q_count++];
+	struct btree *cat = queue->q_btree;
+
+	subtree->s_child_id = child_id;
+	subtree->s_first_key = *key;
+	subtree->s_btree.type = cat->type;
+	subtree->s_btree.root = cat->root;
+	subtree->s_btree.omap_table = cat->omap_table;
+	subtree->s_btree.defer_records = true;
+}
+
 /**
  * parse_subtree - Parse a subtree and check for corruption
  * @root:	root node of the subtree
@@ -717,6 +1088,8 @@ static void parse_subtree(struct node *root,
 			report("Snap meta tree", "has no root node.");
 	}
 
+	node_prefetch_children(root);
+
 	for (i = 0; i < root->records; ++i) {
 		struct node *child;
 		void *raw = root->raw;
@@ -727,7 +1100,9 @@ static void parse_subtree(struct node *root,
 		len = node_locate_key(root, i, &off);
 		if (len > btree->longest_key)
 			btree->longest_key = len;
-		bmap_mark_as_used(root->used_key_bmap, off - root->key, len);
+		if (!root->verified)
+			bmap_mark_as_used(root->used_key_bmap, off - root->key,
+					  len);
 		raw_key = raw + off;
 
 		if (btree_is_omap(btree)) {
@@ -756,13 +1131,15 @@ static void parse_subtree(struct node *root,
 		*last_key = curr_key;
 
 		len = node_locate_data(root, i, &off);
-		bmap_mark_as_used(root->used_val_bmap, off - root->data, len);
+		if (!root->verified)
+			bmap_mark_as_used(root->used_val_bmap, off - root->data,
+					  len);
 		raw_val = raw + off;
 
 		if (node_is_leaf(root)) {
 			if (len > btree->longest_val)
 				btree->longest_val = len;
-			if (btree_is_catalog(btree))
+			if (btree_is_catalog(btree) && !btree->defer_records)
 				parse_cat_record(raw_key, raw_val, len);
 			if (btree_is_omap(btree))
 				parse_omap_record(raw_key, raw_val, len);
@@ -779,6 +1156,13 @@ static void parse_subtree(struct node *root,
 		if (len != 8)
 			report("B-tree", "wrong size of nonleaf record value.");
 		child_id = le64_to_cpu(*(__le64 *)(raw_val));
+
+		/* Other threads will take care of the children of the root */
+		if (btree->queue && root == btree->root) {
+			queue_cat_subtree(btree->queue, child_id, last_key);
+			continue;
+		}
+
 		child = read_node(child_id, btree);
 
 		if (child->level != root->level - 1)
@@ -793,11 +1177,17 @@ static void parse_subtree(struct node *root,
 			       "xid of node is older than xid of its child.");
 
 		parse_subtree(child, last_key, name_buf);
-		node_free(child);
+		if (btree->defer_records && node_is_leaf(child))
+			node_defer(child);
+		else
+			node_free(child);
 	}
 
 	/* All records of @root are processed, so it's a good time for this */
-	node_compare_bmaps(root);
+	if (!root->verified) {
+		node_compare_bmaps(root);
+		node_set_verified(root);
+	}
 
 	/*
 	 * last_key->name is just a pointer to the memory-mapped on-disk name
@@ -1015,6 +1405,189 @@ struct btree *parse_snap_meta_btree(u64 oid)
 	return snap;
 }
 
+/**
+ * check_cat_subtree - Check a subtree of the catalog root, but not its records
+ * @subtree:	the subtree
+ *
+ * The leaves are set aside in @subtree, for their records to be parsed later.
+ */
+static void check_cat_subtree(struct cat_subtree *subtree)
+{
+	struct btree *btree = &subtree->s_btree;
+	struct node *child;
+
+	child = read_node(subtree->s_child_id, btree);
+	if (child->level != btree->root->level - 1)
+		report("B-tree", "node levels are corrupted.");
+	if (node_is_root(child))
+		report("B-tree", "nonroot node is flagged as root.");
+
+	subtree->s_last_key = subtree->s_first_key;
+	parse_subtree(child, &subtree->s_last_key, subtree->s_name_buf);
+	if (node_is_leaf(child))
+		node_defer(child);
+	else
+		node_free(child);
+}
+
+/**
+ * cat_worker - Thread function that checks catalog subtrees until none are left
+ * @arg: the queue of subtrees
+ */
+static void *cat_worker(void *arg)
+{
+	struct cat_queue *queue = arg;
+	int i;
+
+	vsb = queue->q_vsb;
+
+	pthread_mutex_lock(&queue->q_lock);
+	while (queue->q_next < queue->q_count) {
+		if (queue->q_next >= queue->q_parsed + queue->q_window) {
+			pthread_cond_wait(&queue->q_cond, &queue->q_lock);
+			continue;
+		}
+		i = queue->q_next++;
+		pthread_mutex_unlock(&queue->q_lock);
+
+		check_cat_subtree(&queue->q_subtrees[i]);
+
+		pthread_mutex_lock(&queue->q_lock);
+		queue->q_subtrees[i].s_done = true;
+		pthread_cond_broadcast(&queue->q_cond);
+	}
+	pthread_mutex_unlock(&queue->q_lock);
+	return NULL;
+}
+
+/**
+ * parse_deferred_records - Parse the records of a leaf that was set aside
+ * @node: the leaf, which gets freed here
+ */
+static void parse_deferred_records(struct node *node)
+{
+	int i;
+
+	/* The block was released by node_defer(), and was already checked */
+	node->raw = read_block(node->object.block_nr);
+	for (i = 0; i < node->records; ++i) {
+		int key_off, off, len;
+
+		node_locate_key(node, i, &key_off);
+		len = node_locate_data(node, i, &off);
+		parse_cat_record((void *)node->raw + key_off,
+				 (void *)node->raw + off, len);
+	}
+	node_free(node);
+}
+
+/**
+ * parse_cat_subtrees - Check the queued subtrees of the catalog root
+ * @cat: the catalog, with all the subtrees of the root queued
+ *
+ * Up to @jobs threads check the subtrees at the same time, the caller among
+ * them.  The caller then parses the records of each subtree in key order,
+ * checks the ordering across subtrees, and adds up the stats.
+ */
+static void parse_cat_subtrees(struct btree *cat)
+{
+	struct cat_queue *queue = cat->queue;
+	struct key *last_key = NULL;
+	pthread_t *threads;
+	int max_threads, thread_count = 0;
+	int i, j;
+
+	/* One of the jobs is the calling thread itself */
+	max_threads = jobs < queue->q_count ? jobs : queue->q_count;
+	max_threads = max_threads > 1 ? max_threads - 1 : 0;
+	threads = max_threads ? calloc(max_threads, sizeof(*threads)) : NULL;
+	if (max_threads && !threads)
+		system_error();
+	while (thread_count < max_threads) {
+		if (pthread_create(&threads[thread_count], NULL, cat_worker,
+				   queue))
+			break;
+		++thread_count;
+	}
+
+	for (i = 0; i < queue->q_count; ++i) {
+		struct cat_subtree *subtree = &queue->q_subtrees[i];
+		struct btree *btree = &subtree->s_btree;
+
+		pthread_mutex_lock(&queue->q_lock);
+		while (!subtree->s_done) {
+			if (queue->q_next != i) {
+				pthread_cond_wait(&queue->q_cond,
+						  &queue->q_lock);
+				continue;
+			}
+			/* Nobody has claimed the subtree yet, so do it here */
+			++queue->q_next;
+			pthread_mutex_unlock(&queue->q_lock);
+			check_cat_subtree(subtree);
+			pthread_mutex_lock(&queue->q_lock);
+			subtree->s_done = true;
+		}
+		queue->q_parsed = i + 1;
+		pthread_cond_broadcast(&queue->q_cond);
+		pthread_mutex_unlock(&queue->q_lock);
+
+		if (last_key && keycmp(last_key, &subtree->s_first_key) > 0)
+			report("B-tree", "keys are out of order.");
+		last_key = &subtree->s_last_key;
+
+		for (j = 0; j < btree->deferred_count; ++j)
+			parse_deferred_records(btree->deferred[j]);
+		free(btree->deferred);
+
+		cat->key_count += btree->key_count;
+		cat->node_count += btree->node_count;
+		if (btree->longest_key > cat->longest_key)
+			cat->longest_key = btree->longest_key;
+		if (btree->longest_val > cat->longest_val)
+			cat->longest_val = btree->longest_val;
+	}
+
+	for (i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/**
+ * alloc_cat_queue - Set up a queue for the subtrees of the catalog root
+ * @cat: the catalog, with the root already read
+ */
+static struct cat_queue *alloc_cat_queue(struct btree *cat)
+{
+	struct cat_queue *queue;
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		system_error();
+	queue->q_subtrees = calloc(cat->root->records,
+				   sizeof(*queue->q_subtrees));
+	if (!queue->q_subtrees)
+		system_error();
+	queue->q_btree = cat;
+	queue->q_vsb = vsb;
+	queue->q_window = jobs * CAT_QUEUE_WINDOW_PER_JOB;
+	pthread_mutex_init(&queue->q_lock, NULL);
+	pthread_cond_init(&queue->q_cond, NULL);
+	return queue;
+}
+
+/**
+ * free_cat_queue - Free a queue of catalog subtrees
+ * @queue: the queue
+ */
+static void free_cat_queue(struct cat_queue *queue)
+{
+	pthread_mutex_destroy(&queue->q_lock);
+	pthread_cond_destroy(&queue->q_cond);
+	free(queue->q_subtrees);
+	free(queue);
+}
+
 /**
  * parse_cat_btree - Parse a catalog tree and check for corruption
  * @oid:	object id for the catalog root
@@ -1022,7 +1595,7 @@ struct btree *parse_snap_meta_btree(u64 oid)
  *
  * Returns a pointer to the btree struct for the catalog.
  */
-struct btree *parse_cat_btree(u64 oid, struct htable_entry **omap_table)
+struct btree *parse_cat_btree(u64 oid, struct htable *omap_table)
 {
 	struct btree *cat;
 	struct key last_key = {0};
@@ -1034,9 +1607,20 @@ struct btree *parse_cat_btree(u64 oid, struct htable_entry **omap_table)
 
 	cat->type = BTREE_TYPE_CATALOG;
 	cat->omap_table = omap_table;
+	if (options & OPT_PHYSICAL_SWEEP)
+		sweep_virtual_tree(omap_table);
 	cat->root = read_node(oid, cat);
 
+	/* Big catalogs get their subtrees checked by several threads */
+	if (jobs > 1 && !node_is_leaf(cat->root) && cat->root->records)
+		cat->queue = alloc_cat_queue(cat);
+
 	parse_subtree(cat->root, &last_key, name_buf);
+	if (cat->queue) {
+		parse_cat_subtrees(cat);
+		free_cat_queue(cat->queue);
+		cat->queue = NULL;
+	}
 
 	check_btree_footer(cat);
 	return cat;
@@ -1109,7 +1693,7 @@ struct btree *parse_omap_btree(u64 oid)
 	parse_subtree(omap->root, &last_key, NULL /* name_buf */);
 
 	check_btree_footer(omap);
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 	return omap;
 }
 
@@ -1129,6 +1713,8 @@ struct btree *parse_extentref_btree(u64 oid)
 		system_error();
 	extref->type = BTREE_TYPE_EXTENTREF;
 	extref->omap_table = NULL; /* These are physical objects */
+	if (options & OPT_PHYSICAL_SWEEP)
+		sweep_physical_tree(extref, oid);
 	extref->root = read_node(oid, extref);
 
 	parse_subtree(extref->root, &last_key, NULL /* name_buf */);
@@ -1136,351 +1722,3 @@ struct btree *parse_extentref_btree(u64 oid)
 	check_btree_footer(extref);
 	return extref;
 }
-
-/**
- * child_from_query - Read the child id found by a successful nonleaf query
- * @query:	the query that found the record
- *
- * Returns the child id in the nonleaf node record.
- */
-static u64 child_from_query(struct query *query)
-{
-	void *raw = query->node->raw;
-
-	/* This check is actually redundant, at least for now */
-	if (query->len != 8) /* The data on a nonleaf node is the child id */
-		report("B-tree", "wrong size of nonleaf record value.");
-
-	return le64_to_cpu(*(__le64 *)(raw + query->off));
-}
-
-/**
- * extref_rec_from_query - Read the info found by a successful extentref query
- * @query:	the query for the extent reference record
- * @extref:	extent reference record struct to receive the result
- */
-static void extref_rec_from_query(struct query *query,
-				  struct extref_record *extref)
-{
-	struct apfs_phys_ext_val *extref_val;
-	struct apfs_phys_ext_key *extref_key;
-	void *raw = query->node->raw;
-
-	if (query->len != sizeof(*extref_val))
-		report("Extent reference record", "wrong size of value.");
-
-	extref_val = (struct apfs_phys_ext_val *)(raw + query->off);
-	extref_key = (struct apfs_phys_ext_key *)(raw + query->key_off);
-
-	/* The physical address is used as the id in the extentref tree */
-	extref->phys_addr = cat_cnid(&extref_key->hdr);
-	extref->blocks = le64_to_cpu(extref_val->len_and_kind) &
-							APFS_PEXT_LEN_MASK;
-	extref->owner = le64_to_cpu(extref_val->owning_obj_id);
-	extref->refcnt = le32_to_cpu(extref_val->refcnt);
-}
-
-/**
- * extentref_lookup - Find the best match for an extent in the extentref tree
- * @tbl:	root of the extent reference tree to be searched
- * @bno:	first block number for the extent
- * @extref:	extentref record struct to receive the result
- */
-void extentref_lookup(struct node *tbl, u64 bno, struct extref_record *extref)
-{
-	struct query *query;
-	struct key key;
-
-	query = alloc_query(tbl, NULL /* parent */);
-
-	init_extref_key(bno, &key);
-	query->key = &key;
-	query->flags |= QUERY_EXTENTREF;
-
-	/*
-	 * The extentref nodes have already been parsed, and the allocation
-	 * bitmap has been updated accordingly.  This global variable tells
-	 * read_object() to ignore the bitmap this time.
-	 */
-	ongoing_query = true;
-	if (btree_query(&query)) {
-		report("Extent reference tree",
-		       "record missing for block number 0x%llx.",
-		       (unsigned long long)bno);
-	}
-	ongoing_query = false;
-
-	extref_rec_from_query(query, extref);
-	free_query(query);
-}
-
-/**
- * alloc_query - Allocates a query structure
- * @node:	node to be searched
- * @parent:	query for the parent node
- *
- * Callers other than btree_query() should set @parent to NULL, and @node
- * to the root of the b-tree. They should also initialize most of the query
- * fields themselves; when @parent is not NULL the query will inherit them.
- *
- * Returns the allocated query.
- */
-struct query *alloc_query(struct node *node, struct query *parent)
-{
-	struct query *query;
-
-	query = malloc(sizeof(*query));
-	if (!query)
-		system_error();
-
-	query->node = node;
-	query->key = parent ? parent->key : NULL;
-	query->flags = parent ? parent->flags & ~(QUERY_DONE | QUERY_NEXT) : 0;
-	query->parent = parent;
-	/* Start the search with the last record and go backwards */
-	query->index = node->records;
-	query->depth = parent ? parent->depth + 1 : 0;
-
-	return query;
-}
-
-/**
- * free_query - Free a query structure
- * @query:	query to free
- *
- * Also frees the ancestor queries, if they are kept.
- */
-void free_query(struct query *query)
-{
-	while (query) {
-		struct query *parent = query->parent;
-
-		node_free(query->node);
-		free(query);
-		query = parent;
-	}
-}
-
-/**
- * key_from_query - Read the current key from a query structure
- * @query:	the query, with @query->key_off and @query->key_len already set
- * @key:	return parameter for the key
- *
- * Reads the key into @key after some basic sanity checks.
- */
-static void key_from_query(struct query *query, struct key *key)
-{
-	void *raw = query->node->raw;
-	void *raw_key = (void *)(raw + query->key_off);
-
-	switch (query->flags & QUERY_TREE_MASK) {
-	case QUERY_CAT:
-		read_cat_key(raw_key, query->key_len, key);
-		break;
-	case QUERY_OMAP:
-		read_omap_key(raw_key, query->key_len, key);
-		break;
-	case QUERY_EXTENTREF:
-		read_extentref_key(raw_key, query->key_len, key);
-		break;
-	default:
-		report(NULL, "Bug!");
-	}
-
-	if (query->flags & QUERY_MULTIPLE) {
-		/* A multiple query must ignore these fields */
-		key->number = 0;
-		key->name = NULL;
-	}
-}
-
-/**
- * node_next - Find the next matching record in the current node
- * @query:	multiple query in execution
- *
- * Returns 0 on success, -EAGAIN if the next record is in another node, and
- * -ENODATA if no more matching records exist.
- */
-static int node_next(struct query *query)
-{
-	struct node *node = query->node;
-	struct key curr_key;
-	int cmp;
-	u64 bno = node->object.block_nr;
-
-	if (query->flags & QUERY_DONE)
-		/* Nothing left to search; the query failed */
-		return -ENODATA;
-
-	if (!query->index) /* The next record may be in another node */
-		return -EAGAIN;
-	--query->index;
-
-	query->key_len = node_locate_key(node, query->index, &query->key_off);
-	key_from_query(query, &curr_key);
-
-	cmp = keycmp(&curr_key, query->key);
-
-	if (cmp > 0)
-		report("B-tree", "records are out of order.");
-
-	if (cmp != 0 && node_is_leaf(node) && query->flags & QUERY_EXACT)
-		return -ENODATA;
-
-	query->len = node_locate_data(node, query->index, &query->off);
-	if (query->len == 0) {
-		report("B-tree", "corrupted record value in node 0x%llx.",
-		       (unsigned long long)bno);
-	}
-
-	if (cmp != 0) {
-		/*
-		 * This is the last entry that can be relevant in this node.
-		 * Keep searching the children, but don't return to this level.
-		 */
-		query->flags |= QUERY_DONE;
-	}
-
-	return 0;
-}
-
-/**
- * node_query - Execute a query on a single node
- * @query:	the query to execute
- *
- * The search will start at index @query->index, looking for the key that comes
- * right before @query->key, according to the order given by keycmp().
- *
- * The @query->index will be updated to the last index checked. This is
- * important when searching for multiple entries, since the query may need
- * to remember where it was on this level. If we are done with this node, the
- * query will be flagged as QUERY_DONE, and the search will end in failure
- * as soon as we return to this level. The function may also return -EAGAIN,
- * to signal that the search should go on in a different branch.
- *
- * On success returns 0; the offset of the data within the block will be saved
- * in @query->off, and its length in @query->len. The function checks that this
- * length fits within the block; callers must use the returned value to make
- * sure they never operate outside its bounds.
- *
- * -ENODATA will be returned if no appropriate entry was found.
- */
-static int node_query(struct query *query)
-{
-	struct node *node = query->node;
-	int left, right;
-	int cmp;
-	u64 bno = node->object.block_nr;
-
-	if (query->flags & QUERY_NEXT)
-		return node_next(query);
-
-	/* Search by bisection */
-	cmp = 1;
-	left = 0;
-	do {
-		struct key curr_key;
-		if (cmp > 0) {
-			right = query->index - 1;
-			if (right < left)
-				return -ENODATA;
-			query->index = (left + right) / 2;
-		} else {
-			left = query->index;
-			query->index = DIV_ROUND_UP(left + right, 2);
-		}
-
-		query->key_len = node_locate_key(node, query->index,
-						 &query->key_off);
-		key_from_query(query, &curr_key);
-
-		cmp = keycmp(&curr_key, query->key);
-		if (cmp == 0 && !(query->flags & QUERY_MULTIPLE))
-			break;
-	} while (left != right);
-
-	if (cmp > 0)
-		return -ENODATA;
-
-	if (cmp != 0 && node_is_leaf(query->node) && query->flags & QUERY_EXACT)
-		return -ENODATA;
-
-	if (query->flags & QUERY_MULTIPLE) {
-		if (cmp != 0) /* Last relevant entry in level */
-			query->flags |= QUERY_DONE;
-		query->flags |= QUERY_NEXT;
-	}
-
-	query->len = node_locate_data(node, query->index, &query->off);
-	if (query->len == 0) {
-		report("B-tree", "corrupted record value in node 0x%llx.",
-		       (unsigned long long)bno);
-	}
-	return 0;
-}
-
-/**
- * btree_query - Execute a query on a b-tree
- * @query:	the query to execute
- *
- * Searches the b-tree starting at @query->index in @query->node, looking for
- * the record corresponding to @query->key.
- *
- * Returns 0 in case of success and sets the @query->len, @query->off and
- * @query->index fields to the results of the query. @query->node will now
- * point to the leaf node holding the record.
- *
- * In case of failure returns -ENODATA.
- */
-int btree_query(struct query **query)
-{
-	struct node *node = (*query)->node;
-	struct query *parent;
-	struct btree *btree = node->btree;
-	u64 child_id;
-	int err;
-
-	assert(ongoing_query);
-
-next_node:
-	if ((*query)->depth >= 12) {
-		/* This is the maximum depth allowed by the module */
-		report("B-tree", "is too deep.");
-	}
-
-	err = node_query(*query);
-	if (err == -EAGAIN) {
-		if (!(*query)->parent) /* We are at the root of the tree */
-			return -ENODATA;
-
-		/* Move back up one level and continue the query */
-		parent = (*query)->parent;
-		(*query)->parent = NULL; /* Don't free the parent */
-		free_query(*query);
-		*query = parent;
-		goto next_node;
-	}
-	if (err)
-		return err;
-	if (node_is_leaf((*query)->node)) /* All done */
-		return 0;
-
-	/* Now go a level deeper and search the child */
-	child_id = child_from_query(*query);
-	node = read_node(child_id, btree);
-
-	if ((*query)->flags & QUERY_MULTIPLE) {
-		/*
-		 * We are looking for multiple entries, so we must remember
-		 * the parent node and index to continue the search later.
-		 */
-		*query = alloc_query(node, *query);
-	} else {
-		/* Reuse the same query structure to search the child */
-		node_free((*query)->node);
-		(*query)->node = node;
-		(*query)->index = node->records;
-		(*query)->depth++;
-	}
-	goto next_node;
-}
@@ -11,8 +11,8 @@
 #include "object.h"
 
 struct super_block;
-struct extref_record;
 struct free_queue;
+struct cat_queue;
 
 /*
  * Omap record data in memory
@@ -38,10 +38,11 @@ struct node {
 	int free;		/* Offset of the free area in the block */
 	int data;		/* Offset of the data area in the block */
 
-	u8 *free_key_bmap;	/* Free space bitmap for the key area */
-	u8 *free_val_bmap;	/* Free space bitmap for the value area */
-	u8 *used_key_bmap;	/* Used space bitmap for the key area */
-	u8 *used_val_bmap;	/* Used space bitmap for the value area */
+	u64 *free_key_bmap;	/* Free space bitmap for the key area */
+	u64 *free_val_bmap;	/* Free space bitmap for the value area */
+	u64 *used_key_bmap;	/* Used space bitmap for the key area */
+	u64 *used_val_bmap;	/* Used space bitmap for the value area */
+	bool verified;		/* Space checks were done for an older copy */
 
 	struct btree *btree;			/* Btree the node belongs to */
 	struct apfs_btree_node_phys *raw;	/* Raw node in memory */
@@ -76,37 +77,6 @@ static inline bool node_has_fixed_kv_size(struct node *node)
 	return (node->flags & APFS_BTNODE_FIXED_KV_SIZE) != 0;
 }
 
-/* Flags for the query structure */
-#define QUERY_TREE_MASK		0007	/* Which b-tree we query */
-#define QUERY_OMAP		0001	/* This is a b-tree object map query */
-#define QUERY_CAT		0002	/* This is a catalog tree query */
-#define QUERY_EXTENTREF		0004	/* This is an extentref tree query */
-#define QUERY_MULTIPLE		0010	/* Search for multiple matches */
-#define QUERY_NEXT		0020	/* Find next of multiple matches */
-#define QUERY_EXACT		0040	/* Search for an exact match */
-#define QUERY_DONE		0100	/* The search at this level is over */
-
-/*
- * Structure used to retrieve data from an APFS B-Tree. For now only used
- * on the calalog and the object map.
- */
-struct query {
-	struct node *node;		/* Node being searched */
-	struct key *key;		/* What the query is looking for */
-
-	struct query *parent;		/* Query for parent node */
-	unsigned int flags;
-
-	/* Set by the query on success */
-	int index;			/* Index of the entry in the node */
-	int key_off;			/* Offset of the key in the node */
-	int key_len;			/* Length of the key */
-	int off;			/* Offset of the data in the node */
-	int len;			/* Length of the data */
-
-	int depth;			/* Put a limit on recursion */
-};
-
 /* In-memory tree types */
 #define BTREE_TYPE_OMAP		1 /* The tree is an object map */
 #define BTREE_TYPE_CATALOG	2 /* The tree is a catalog */
@@ -120,13 +90,21 @@ struct btree {
 	struct node *root;	/* Root of this b-tree */
 
 	/* Hash table for the tree's object map (can be NULL) */
-	struct htable_entry **omap_table;
+	struct htable *omap_table;
 
 	/* B-tree stats as measured by the fsck */
 	u64 key_count;		/* Number of keys */
 	u64 node_count;		/* Number of nodes */
 	int longest_key;	/* Length of longest key */
 	int longest_val;	/* Length of longest value */
+
+	/* Subtrees of the root left for other threads (can be NULL) */
+	struct cat_queue *queue;
+
+	/* Leaves set aside to have their records parsed later, in order */
+	bool defer_records;	/* Should the records be set aside? */
+	struct node **deferred;	/* Array of leaves */
+	int deferred_count;	/* Number of leaves in the array */
 };
 
 /**
@@ -178,15 +156,11 @@ extern struct free_queue *parse_free_queue_btree(u64 oid, int index);
 extern struct btree *parse_snap_meta_btree(u64 oid);
 extern struct btree *parse_extentref_btree(u64 oid);
 extern struct btree *parse_omap_btree(u64 oid);
-extern struct btree *parse_cat_btree(u64 oid, struct htable_entry **omap_table);
-extern struct query *alloc_query(struct node *node, struct query *parent);
-extern void free_query(struct query *query);
-extern int btree_query(struct query **query);
+extern void free_verified_nodes(void);
+extern struct btree *parse_cat_btree(u64 oid, struct htable *omap_table);
 extern struct node *omap_read_node(u64 id);
-extern void free_omap_table(struct htable_entry **table);
+extern void free_omap_table(struct htable *table);
 extern struct omap_record *get_omap_record(u64 oid,
-					   struct htable_entry **table);
-extern void extentref_lookup(struct node *tbl, u64 bno,
-			     struct extref_record *extref);
+					   struct htable *table);
 
 #endif	/* _BTREE_H */
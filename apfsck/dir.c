@@ -134,10 +134,7 @@ void parse_dentry_record(void *key, struct apfs_drec_val *val, int len)
 
 	if (!inode->i_first_name) {
 		/* No dentry for this inode has been seen before */
-		inode->i_first_name = malloc(namelen);
-		if (!inode->i_first_name)
-			system_error();
-		strcpy(inode->i_first_name, name);
+		inode->i_first_name = arena_strdup(vsb->v_arena, name);
 		inode->i_first_parent = parent_ino;
 	}
 
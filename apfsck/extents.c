@@ -12,6 +12,7 @@
 #include "htable.h"
 #include "inode.h"
 #include "key.h"
+#include "stats.h"
 #include "super.h"
 
 /**
@@ -24,15 +25,13 @@ static void free_extent(struct htable_entry *entry)
 
 	if (extent->e_refcnt != extent->e_references)
 		report("Physical extent record", "bad reference count.");
-
-	free(entry);
 }
 
 /**
  * free_extent_table - Free the extent hash table and all its entries
  * @table: table to free
  */
-void free_extent_table(struct htable_entry **table)
+void free_extent_table(struct htable *table)
 {
 	free_htable(table, free_extent);
 }
@@ -102,7 +101,6 @@ static void free_dstream(struct htable_entry *entry)
 
 	/* Increase the refcount of each physical extent used by the dstream */
 	while (curr_extent) {
-		struct listed_extent *next_extent;
 		struct extent *extent;
 
 		extent = get_extent(curr_extent->paddr);
@@ -119,20 +117,17 @@ static void free_dstream(struct htable_entry *entry)
 		extent->e_obj_type = dstream->d_obj_type;
 		extent->e_latest_owner = dstream->d_owner;
 
-		next_extent = curr_extent->next;
-		free(curr_extent);
-		curr_extent = next_extent;
+		curr_extent = curr_extent->next;
 	}
 
 	check_dstream_stats(dstream);
-	free(entry);
 }
 
 /**
  * free_dstream_table - Free the dstream hash table and all its entries
  * @table: table to free
  */
-void free_dstream_table(struct htable_entry **table)
+void free_dstream_table(struct htable *table)
 {
 	free_htable(table, free_dstream);
 }
@@ -152,6 +147,55 @@ struct dstream *get_dstream(u64 id)
 	return (struct dstream *)entry;
 }
 
+/**
+ * find_extref - Find the physical extent that may contain a block
+ * @bno: the block number
+ *
+ * Returns the last extent in the extentref tree that starts at or before @bno;
+ * the caller must still check that the block is inside it.
+ *
+ * The extents of a file are often laid out in order on disk, so the search
+ * starts from the last extent found, and gallops forward from there.  If that
+ * doesn't work out, it falls back to a binary search over the whole array.
+ */
+static struct extref_record *find_extref(u64 bno)
+{
+	struct extref_record *extrefs = vsb->v_extrefs;
+	u64 count = vsb->v_extref_count;
+	u64 start = 0, end = count;
+	u64 finger = vsb->v_extref_finger;
+
+	STATS_ADD(c_extref_lookups, 1);
+	if (finger < count && extrefs[finger].phys_addr <= bno) {
+		u64 step = 1;
+
+		/* Find a range that ends past @bno, doubling its size */
+		start = finger + 1;
+		while (start + step <= count &&
+		       extrefs[start + step - 1].phys_addr <= bno) {
+			start += step;
+			step <<= 1;
+		}
+		end = start + step - 1 < count ? start + step - 1 : count;
+	}
+
+	while (start < end) {
+		u64 mid = start + (end - start) / 2;
+
+		if (extrefs[mid].phys_addr <= bno)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	if (!start)
+		report("Extent reference tree",
+		       "record missing for block number 0x%llx.",
+		       (unsigned long long)bno);
+	vsb->v_extref_finger = start - 1;
+	return &extrefs[start - 1];
+}
+
 /**
  * attach_prange_to_dstream - Attach a physical range to a dstream structure
  * @paddr:	physical address of the range
@@ -164,16 +208,16 @@ static void attach_extent_to_dstream(u64 paddr, u64 blk_count,
 	struct listed_extent **ext_p = &dstream->d_extents;
 	struct listed_extent *ext = *ext_p;
 	struct listed_extent *new;
-	struct extref_record extref;
+	struct extref_record *extref;
 
 	if (paddr + blk_count < paddr) /* Overflow */
 		report("Extent record", "physical address is too big.");
 
 	/* Find out which physical extent contains this address range */
-	extentref_lookup(vsb->v_extent_ref->root, paddr, &extref);
-	if (extref.phys_addr + extref.blocks < paddr + blk_count)
+	extref = find_extref(paddr);
+	if (extref->phys_addr + extref->blocks < paddr + blk_count)
 		report("Extent record", "no entry in extent reference tree.");
-	paddr = extref.phys_addr;
+	paddr = extref->phys_addr;
 
 	/* Entries are ordered by their physical address */
 	while (ext) {
@@ -187,10 +231,7 @@ static void attach_extent_to_dstream(u64 paddr, u64 blk_count,
 		ext = *ext_p;
 	}
 
-	new = malloc(sizeof(*new));
-	if (!new)
-		system_error();
-
+	new = arena_alloc(vsb->v_arena, sizeof(*new));
 	new->paddr = paddr;
 	new->next = ext;
 	*ext_p = new;
@@ -260,6 +301,36 @@ void parse_dstream_id_record(struct apfs_dstream_id_key *key,
 	dstream->d_refcnt = le32_to_cpu(val->refcnt);
 }
 
+/**
+ * add_extref - Add a physical extent to the sorted array for the volume
+ * @paddr:	first block number
+ * @blocks:	block count
+ * @owner:	owning object id
+ * @refcnt:	reference count
+ *
+ * The extentref tree is parsed in order, and its extents must not overlap,
+ * so the array stays sorted if each new extent just goes at the end.
+ */
+static void add_extref(u64 paddr, u64 blocks, u64 owner, u32 refcnt)
+{
+	struct extref_record *extref;
+	u64 count = vsb->v_extref_count;
+
+	/* Double the size of the array each time it gets full */
+	if (!(count & (count - 1))) {
+		vsb->v_extrefs = realloc(vsb->v_extrefs, (count ? 2 * count : 1) *
+						sizeof(*vsb->v_extrefs));
+		if (!vsb->v_extrefs)
+			system_error();
+	}
+
+	extref = &vsb->v_extrefs[vsb->v_extref_count++];
+	extref->phys_addr = paddr;
+	extref->blocks = blocks;
+	extref->owner = owner;
+	extref->refcnt = refcnt;
+}
+
 /**
  * parse_phys_ext_record - Parse and check a physical extent record value
  * @key:	pointer to the raw key
@@ -307,6 +378,7 @@ u64 parse_phys_ext_record(struct apfs_phys_ext_key *key,
 
 	extent = get_extent(cat_cnid(&key->hdr));
 	extent->e_refcnt = refcnt;
+	add_extref(extent->e_bno, length, owner, refcnt);
 
 	vsb->v_block_count += length;
 	container_bmap_mark_as_used(extent->e_bno, length);
@@ -13,7 +13,9 @@ struct apfs_dstream_id_key;
 struct apfs_phys_ext_key;
 
 /*
- * Physical extent record in memory, to be filled by extentref_lookup()
+ * Physical extent record in memory.  One of these is kept for each record of
+ * the extentref tree, in a sorted array, so that the extent that contains a
+ * given block can be found with a binary search.
  */
 struct extref_record {
 	u64 phys_addr;	/* First block number */
@@ -74,8 +76,8 @@ struct dstream {
 };
 #define d_id	d_htable.h_id		/* Dstream id */
 
-extern void free_dstream_table(struct htable_entry **table);
-extern void free_extent_table(struct htable_entry **table);
+extern void free_dstream_table(struct htable *table);
+extern void free_extent_table(struct htable *table);
 extern struct dstream *get_dstream(u64 ino);
 extern void parse_extent_record(struct apfs_file_extent_key *key,
 				struct apfs_file_extent_val *val, int len);
@@ -2,83 +2,254 @@
  * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
  */
 
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <apfs/types.h>
 #include "apfsck.h"
 #include "htable.h"
+#include "stats.h"
 #include "super.h"
 
+/**
+ * alloc_htable_slots - Allocate the slot array for a hash table
+ * @table:	the hash table
+ * @count:	number of slots, must be a power of two
+ */
+static void alloc_htable_slots(struct htable *table, u64 count)
+{
+	table->t_slots = calloc(count, sizeof(*table->t_slots));
+	if (!table->t_slots)
+		system_error();
+	table->t_mask = count - 1;
+}
+
 /**
  * alloc_htable - Allocates and returns an empty hash table
+ * @arena: arena for the entries of the table
  */
-struct htable_entry **alloc_htable(void)
+struct htable *alloc_htable(struct arena *arena)
 {
-	struct htable_entry **table;
+	struct htable *table;
 
-	table = calloc(HTABLE_BUCKETS, sizeof(*table));
+	table = calloc(1, sizeof(*table));
 	if (!table)
 		system_error();
+	alloc_htable_slots(table, HTABLE_MIN_SLOTS);
+	table->t_arena = arena;
 	return table;
 }
 
 /**
- * free_htable - Free a hash table and all its entries
+ * compare_entries - Compare two hash table entries by id, for qsort()
+ * @a: pointer to the first entry pointer
+ * @b: pointer to the second entry pointer
+ */
+static int compare_entries(const void *a, const void *b)
+{
+	const struct htable_entry *e1 = *(struct htable_entry **)a;
+	const struct htable_entry *e2 = *(struct htable_entry **)b;
+
+	if (e1->h_id < e2->h_id)
+		return -1;
+	return e1->h_id > e2->h_id;
+}
+
+/**
+ * free_htable - Free a hash table after running the final checks on its entries
  * @table:	the catalog table to free
- * @free_entry:	function that checks and frees an entry
+ * @free_entry:	function that checks an entry (NULL if no checks are needed)
+ *
+ * The entries are handed to @free_entry in order of increasing id, so that
+ * the report for a corrupted filesystem doesn't depend on the hashing.  Their
+ * memory belongs to the arena of the table, so it's not freed here.
  */
-void free_htable(struct htable_entry **table,
+void free_htable(struct htable *table,
 		 void (*free_entry)(struct htable_entry *))
 {
-	struct htable_entry *current;
-	struct htable_entry *next;
-	int i;
-
-	for (i = 0; i < HTABLE_BUCKETS; ++i) {
-		current = table[i];
-		while (current) {
-			next = current->h_next;
-			free_entry(current);
-			current = next;
-		}
+	struct htable_entry **entries;
+	u64 count = 0;
+	u64 i;
+
+	if (!free_entry)
+		goto out;
+
+	entries = malloc((table->t_count + 1) * sizeof(*entries));
+	if (!entries)
+		system_error();
+	for (i = 0; i <= table->t_mask; ++i) {
+		if (table->t_slots[i].s_entry)
+			entries[count++] = table->t_slots[i].s_entry;
 	}
+	assert(count == table->t_count);
+	qsort(entries, count, sizeof(*entries), compare_entries);
+
+	for (i = 0; i < count; ++i)
+		free_entry(entries[i]);
+
+	free(entries);
+out:
+	free(table->t_slots);
 	free(table);
 }
 
 /**
- * get_htable_entry - Find or create an entry in a hash table
+ * hash_id - Mix the bits of an id to find its home slot in a hash table
+ * @id:	the id
+ *
+ * This is the finalizer from splitmix64.  Ids often have long runs that only
+ * differ in their low bits, or in their high bits, so a good mix is needed.
+ */
+static inline u64 hash_id(u64 id)
+{
+	id ^= id >> 30;
+	id *= 0xbf58476d1ce4e5b9ULL;
+	id ^= id >> 27;
+	id *= 0x94d049bb133111ebULL;
+	id ^= id >> 31;
+	return id;
+}
+
+/**
+ * insert_htable_slot - Put an entry in a hash table known not to contain it
+ * @table:	the hash table
+ * @id:		id of the entry
+ * @entry:	the entry
+ *
+ * On each step of the probe, the entry that is further away from its home
+ * slot keeps the place, and the other one goes on probing.
+ */
+static void insert_htable_slot(struct htable *table, u64 id,
+			       struct htable_entry *entry)
+{
+	u64 mask = table->t_mask;
+	u64 index = hash_id(id) & mask;
+	u64 dist = 0;
+
+	while (1) {
+		struct htable_slot *slot = &table->t_slots[index];
+		struct htable_slot tmp;
+		u64 slot_dist;
+
+		if (!slot->s_entry) {
+			slot->s_id = id;
+			slot->s_entry = entry;
+			return;
+		}
+
+		slot_dist = (index - hash_id(slot->s_id)) & mask;
+		if (slot_dist < dist) {
+			tmp = *slot;
+			slot->s_id = id;
+			slot->s_entry = entry;
+			id = tmp.s_id;
+			entry = tmp.s_entry;
+			dist = slot_dist;
+		}
+
+		index = (index + 1) & mask;
+		++dist;
+	}
+}
+
+/**
+ * grow_htable - Double the number of slots in a hash table
+ * @table: the hash table
+ */
+static void grow_htable(struct htable *table)
+{
+	struct htable_slot *old_slots = table->t_slots;
+	u64 old_count = table->t_mask + 1;
+	u64 i;
+
+	alloc_htable_slots(table, old_count << 1);
+	for (i = 0; i < old_count; ++i) {
+		if (old_slots[i].s_entry)
+			insert_htable_slot(table, old_slots[i].s_id,
+					   old_slots[i].s_entry);
+	}
+	free(old_slots);
+}
+
+/**
+ * count_htable_probes - Update the stats for a hash table lookup
+ * @probes: number of slots visited by the lookup
+ */
+static inline void count_htable_probes(u64 probes)
+{
+	struct stats_counters *counters;
+
+	if (!stats_path)
+		return;
+	counters = get_thread_stats();
+	++counters->c_htable_lookups;
+	counters->c_htable_probes += probes;
+	if (probes > counters->c_htable_max_probes)
+		counters->c_htable_max_probes = probes;
+}
+
+/**
+ * find_htable_entry - Find an entry in a hash table
  * @id:		id of the entry
- * @size:	size of the entry
  * @table:	the hash table
  *
- * Returns the entry, after creating it if necessary.
+ * Returns the entry, or NULL if there is none with this id.
  */
-struct htable_entry *get_htable_entry(u64 id, int size,
-				      struct htable_entry **table)
+struct htable_entry *find_htable_entry(u64 id, struct htable *table)
 {
-	int index = id % HTABLE_BUCKETS; /* Trivial hash function */
-	struct htable_entry **entry_p = table + index;
-	struct htable_entry *entry = *entry_p;
-	struct htable_entry *new;
+	struct htable_entry *entry = NULL;
+	u64 mask = table->t_mask;
+	u64 index = hash_id(id) & mask;
+	u64 dist = 0;
 
-	/* In each linked list, entries are ordered by id */
-	while (entry) {
-		if (id == entry->h_id)
-			return entry;
-		if (id < entry->h_id)
+	/*
+	 * With Robin Hood insertion, the search can stop as soon as it finds
+	 * an entry that is closer to its home slot than the id would be.
+	 */
+	while (1) {
+		struct htable_slot *slot = &table->t_slots[index];
+
+		if (!slot->s_entry)
+			break;
+		if (slot->s_id == id) {
+			entry = slot->s_entry;
+			break;
+		}
+		if (((index - hash_id(slot->s_id)) & mask) < dist)
 			break;
 
-		entry_p = &entry->h_next;
-		entry = *entry_p;
+		index = (index + 1) & mask;
+		++dist;
 	}
 
-	new = calloc(1, size);
-	if (!new)
-		system_error();
+	count_htable_probes(dist + 1);
+	return entry;
+}
 
+/**
+ * get_htable_entry - Find or create an entry in a hash table
+ * @id:		id of the entry
+ * @size:	size of the entry
+ * @table:	the hash table
+ *
+ * Returns the entry, after creating it if necessary.
+ */
+struct htable_entry *get_htable_entry(u64 id, int size, struct htable *table)
+{
+	struct htable_entry *new;
+
+	new = find_htable_entry(id, table);
+	if (new)
+		return new;
+
+	new = arena_alloc(table->t_arena, size);
 	new->h_id = id;
-	new->h_next = entry;
-	*entry_p = new;
+
+	/* Keep the load factor under 3/4 */
+	if ((table->t_count + 1) * 4 > (table->t_mask + 1) * 3)
+		grow_htable(table);
+	insert_htable_slot(table, id, new);
+	++table->t_count;
 	return new;
 }
 
@@ -86,10 +257,10 @@ struct htable_entry *get_htable_entry(u64 id, int size,
  * free_cnid_table - Free the cnid hash table and all its entries
  * @table: table to free
  */
-void free_cnid_table(struct htable_entry **table)
+void free_cnid_table(struct htable *table)
 {
-	/* No checks needed here, just call free() on each entry */
-	free_htable(table, (void (*)(struct htable_entry *))free);
+	/* No checks needed here */
+	free_htable(table, NULL);
 }
 
 /**
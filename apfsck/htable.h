@@ -6,17 +6,41 @@
 #define _HTABLE_H
 
 #include <apfs/types.h>
+#include "arena.h"
 
-#define HTABLE_BUCKETS	512	/* So the hash table array fits in 4k */
+/* Initial number of slots in a hash table, must be a power of two */
+#define HTABLE_MIN_SLOTS	64
 
 /*
  * Structure of the common header for hash table entries
  */
 struct htable_entry {
-	struct htable_entry	*h_next;	/* Next entry in linked list */
 	u64			h_id;		/* Catalog object id of entry */
 };
 
+/*
+ * Slot in the array of a hash table.  The id is kept here as well, so that
+ * probing doesn't need to dereference the entries.
+ */
+struct htable_slot {
+	u64			s_id;		/* Id of the entry */
+	struct htable_entry	*s_entry;	/* The entry, or NULL if empty */
+};
+
+/*
+ * Hash table of entries indexed by id.  It uses open addressing with linear
+ * probing, and Robin Hood insertion to keep all probe sequences short.  The
+ * table grows as needed, but the entries never move, so the callers can hold
+ * on to them.  The entries are allocated from an arena, so they go away along
+ * with it, and not when the table is freed.
+ */
+struct htable {
+	struct htable_slot	*t_slots;	/* Array of slots */
+	u64			t_mask;		/* Number of slots, minus one */
+	u64			t_count;	/* Number of entries */
+	struct arena		*t_arena;	/* Arena for the entries */
+};
+
 /* State of the in-memory listed cnid structure */
 #define CNID_UNUSED		0 /* The cnid is unused */
 #define CNID_USED		1 /* The cnid is used, and can't be reused */
@@ -31,12 +55,13 @@ struct listed_cnid {
 	u8			c_state;
 };
 
-extern struct htable_entry **alloc_htable();
-extern void free_htable(struct htable_entry **table,
+extern struct htable *alloc_htable(struct arena *arena);
+extern void free_htable(struct htable *table,
 			void (*free_entry)(struct htable_entry *));
+extern struct htable_entry *find_htable_entry(u64 id, struct htable *table);
 extern struct htable_entry *get_htable_entry(u64 id, int size,
-					     struct htable_entry **table);
-extern void free_cnid_table(struct htable_entry **table);
+					     struct htable *table);
+extern void free_cnid_table(struct htable *table);
 extern struct listed_cnid *get_listed_cnid(u64 id);
 
 #endif	/* _HTABLE_H */
@@ -58,16 +58,15 @@ static void check_inode_stats(struct inode *inode)
 }
 
 /**
- * free_inode_names - Free all data on an inode's names
- * @inode: inode to free
+ * check_inode_names - Run the final checks on an inode's names
+ * @inode: inode to check
  *
- * Frees the primary name and all sibling links, but not before running a few
- * remaining consistency checks.
+ * Checks the primary name and all sibling links.  Their memory belongs to the
+ * volume arena, so it's not freed here.
  */
-static void free_inode_names(struct inode *inode)
+static void check_inode_names(struct inode *inode)
 {
 	struct sibling *current = inode->i_siblings;
-	struct sibling *next;
 	u32 count = 0;
 
 	if (!inode->i_name) /* Oddly, this seems to be always required */
@@ -88,10 +87,6 @@ static void free_inode_names(struct inode *inode)
 		if (inode->i_parent_id != inode->i_first_parent)
 			report("Inode record", "bad parent for only link.");
 	}
-	free(inode->i_name);
-	inode->i_name = NULL;
-	free(inode->i_first_name);
-	inode->i_first_name = NULL;
 
 	while (current) {
 		struct listed_cnid *cnid;
@@ -107,10 +102,7 @@ static void free_inode_names(struct inode *inode)
 		if (!current->s_mapped)
 			report("Catalog", "no sibling map for link.");
 
-		next = current->s_next;
-		free(current->s_name);
-		free(current);
-		current = next;
+		current = current->s_next;
 		++count;
 	}
 
@@ -145,8 +137,7 @@ static void free_inode(struct htable_entry *entry)
 		cnid->c_state = CNID_DSTREAM_ALLOWED;
 
 	check_inode_stats(inode);
-	free_inode_names(inode);
-	free(entry);
+	check_inode_names(inode);
 }
 
 /**
@@ -156,7 +147,7 @@ static void free_inode(struct htable_entry *entry)
  * Also performs some consistency checks that can only be done after the whole
  * catalog has been parsed.
  */
-void free_inode_table(struct htable_entry **table)
+void free_inode_table(struct htable *table)
 {
 	free_htable(table, free_inode);
 }
@@ -266,10 +257,7 @@ static int read_name_xfield(char *xval, int len, struct inode *inode)
 	if (xval[xlen - 1] != 0)
 		report("Name xfield", "name with no null termination");
 
-	inode->i_name = malloc(xlen);
-	if (!inode->i_name)
-		system_error();
-	strcpy(inode->i_name, xval);
+	inode->i_name = arena_strdup(vsb->v_arena, xval);
 
 	return xlen;
 }
@@ -692,10 +680,7 @@ struct sibling *get_sibling(u64 id, struct inode *inode)
 		entry = *entry_p;
 	}
 
-	new = calloc(1, sizeof(*new));
-	if (!new)
-		system_error();
-
+	new = arena_alloc(vsb->v_arena, sizeof(*new));
 	new->s_checked = false;
 	new->s_id = id;
 	new->s_next = entry;
@@ -721,10 +706,8 @@ void set_or_check_sibling(u64 parent_id, int namelen, u8 *name,
 		sibling->s_parent_ino = parent_id;
 		sibling->s_name_len = namelen;
 
-		sibling->s_name = malloc(namelen);
-		if (!sibling->s_name)
-			system_error();
-		strcpy((char *)sibling->s_name, (char *)name);
+		sibling->s_name = (u8 *)arena_strdup(vsb->v_arena,
+						     (char *)name);
 		return;
 	}
 
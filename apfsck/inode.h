@@ -64,7 +64,7 @@ struct sibling {
 	u8		*s_name;	/* In-memory copy of the name */
 };
 
-extern void free_inode_table(struct htable_entry **table);
+extern void free_inode_table(struct htable *table);
 extern struct inode *get_inode(u64 ino);
 extern void check_inode_ids(u64 ino, u64 parent_ino);
 extern void parse_inode_record(struct apfs_inode_key *key,
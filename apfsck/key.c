@@ -5,7 +5,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <apfs/checksum.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include <apfs/unicode.h>
@@ -84,32 +83,6 @@ int keycmp(struct key *k1, struct key *k2)
 	return strcmp(k1->name, k2->name);
 }
 
-/**
- * dentry_hash - Find the key hash for a given filename
- * @name: filename to hash
- */
-static u32 dentry_hash(const char *name)
-{
-	struct unicursor cursor;
-	bool case_fold = apfs_is_case_insensitive();
-	u32 hash = 0xFFFFFFFF;
-
-	init_unicursor(&cursor, name);
-
-	while (1) {
-		unicode_t utf32;
-
-		utf32 = normalize_next(&cursor, case_fold);
-		if (!utf32)
-			break;
-
-		hash = crc32c(hash, &utf32, sizeof(utf32));
-	}
-
-	/* Leave room for the filename length */
-	return (hash & 0x3FFFFF) << 10;
-}
-
 /**
  * read_dir_rec_key - Parse an on-disk dentry key and check its consistency
  * @raw:	pointer to the raw key
@@ -135,7 +108,8 @@ static void read_dir_rec_key(void *raw, int size, struct key *key)
 		/* The filename length is ignored for the ordering, so mask it away */
 		key->number = le32_to_cpu(raw_key->name_len_and_hash) & ~0x3FFU;
 		key->name = (char *)raw_key->name;
-		if (key->number != dentry_hash(key->name))
+		if (key->number !=
+		    dentry_hash(key->name, apfs_is_case_insensitive()))
 			report("Directory record", "filename hash is corrupted.");
 		namelen = le32_to_cpu(raw_key->name_len_and_hash) & 0x3FFU;
 		if (size != sizeof(*raw_key) + namelen) {
@@ -5,41 +5,81 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
 #include <apfs/checksum.h>
 #include <apfs/raw.h>
 #include "apfsck.h"
+#include "block.h"
 #include "btree.h"
 #include "htable.h"
 #include "object.h"
+#include "stats.h"
 #include "super.h"
 
+/*
+ * Bitmap of the blocks whose checksum has already been verified during this
+ * run, so that b-tree nodes shared by several checkpoints are not summed
+ * again.  It's allocated once the block count of the container is known,
+ * which happens before any threads are started; after that it's only
+ * accessed atomically.
+ */
+static u64 *csum_bmap;
+static u64 csum_bmap_blocks;
+
 int obj_verify_csum(struct apfs_obj_phys *obj)
 {
+	STATS_ADD(c_csum_bytes, sb->s_blocksize - APFS_MAX_CKSUM_SIZE);
 	return  (le64_to_cpu(obj->o_cksum) ==
 		 fletcher64((char *) obj + APFS_MAX_CKSUM_SIZE,
 			    sb->s_blocksize - APFS_MAX_CKSUM_SIZE));
 }
 
+/**
+ * obj_verify_csum_once - Verify the checksum of an object, unless already done
+ * @bno: block number for the object
+ * @obj: the raw object header
+ */
+static bool obj_verify_csum_once(u64 bno, struct apfs_obj_phys *obj)
+{
+	u64 *word;
+	u64 flag;
+
+	if (!csum_bmap && sb->s_block_count) {
+		csum_bmap_blocks = sb->s_block_count;
+		csum_bmap = calloc(DIV_ROUND_UP(csum_bmap_blocks, 64),
+				   sizeof(*csum_bmap));
+		if (!csum_bmap)
+			system_error();
+	}
+	if (!csum_bmap || bno >= csum_bmap_blocks)
+		return obj_verify_csum(obj);
+
+	word = csum_bmap + bno / 64;
+	flag = 1ULL << bno % 64;
+	if (__atomic_load_n(word, __ATOMIC_RELAXED) & flag)
+		return true;
+	if (!obj_verify_csum(obj))
+		return false;
+	__atomic_fetch_or(word, flag, __ATOMIC_RELAXED);
+	return true;
+}
+
 /**
  * read_object_nocheck - Read an object header from disk
  * @bno: block number for the object
  * @obj: object struct to receive the results
  *
  * Returns a pointer to the raw data of the object in memory, without running
- * any checks other than the Fletcher verification.
+ * any checks other than the Fletcher verification.  The caller must give it
+ * back with release_block().
  */
 void *read_object_nocheck(u64 bno, struct object *obj)
 {
 	struct apfs_obj_phys *raw;
 
-	raw = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-		   fd, bno * sb->s_blocksize);
-	if (raw == MAP_FAILED)
-		system_error();
+	raw = read_block(bno);
 
-	/* This one check is always needed */
-	if (!obj_verify_csum(raw)) {
+	/* This one check is always needed, but only once for each block */
+	if (!obj_verify_csum_once(bno, raw)) {
 		report("Object header", "bad checksum in block 0x%llx.",
 		       (unsigned long long)bno);
 	}
@@ -51,6 +91,8 @@ void *read_object_nocheck(u64 bno, struct object *obj)
 	obj->flags = le32_to_cpu(raw->o_type) & APFS_OBJECT_TYPE_FLAGS_MASK;
 	obj->subtype = le32_to_cpu(raw->o_subtype);
 
+	if (stats_path)
+		stats_count_object(obj->type, obj->subtype);
 	return raw;
 }
 
@@ -82,7 +124,7 @@ u32 parse_object_flags(u32 flags)
  * Returns a pointer to the raw data of the object in memory, after checking
  * the consistency of some of its fields.
  */
-void *read_object(u64 oid, struct htable_entry **omap_table, struct object *obj)
+void *read_object(u64 oid, struct htable *omap_table, struct object *obj)
 {
 	struct apfs_obj_phys *raw;
 	struct omap_record *omap_rec;
@@ -91,29 +133,29 @@ void *read_object(u64 oid, struct htable_entry **omap_table, struct object *obj)
 	u32 storage_type;
 
 	if (omap_table) {
-		omap_rec = get_omap_record(oid, omap_table);
-		if (omap_rec->o_seen)
+		/* Several threads may be reading from the same omap */
+		omap_rec = (struct omap_record *)find_htable_entry(oid,
+								   omap_table);
+		if (!omap_rec || !omap_rec->o_bno)
+			report("Object map", "record missing for id 0x%llx.",
+			       (unsigned long long)oid);
+		if (__atomic_exchange_n(&omap_rec->o_seen, true,
+					__ATOMIC_RELAXED))
 			report("Object map record", "oid was used twice.");
-		omap_rec->o_seen = true;
 
 		bno = omap_rec->o_bno;
-		if (!bno)
-			report("Object map", "record missing for id 0x%llx.",
-			       (unsigned long long)oid);
 	} else {
 		bno = oid;
 	}
 
 	raw = read_object_nocheck(bno, obj);
-	if (!ongoing_query) { /* Query code will revisit already parsed nodes */
-		if (vsb)
-			++vsb->v_block_count;
-		if ((obj->type == APFS_OBJECT_TYPE_SPACEMAN_CIB) ||
-		     (obj->type == APFS_OBJECT_TYPE_SPACEMAN_CAB)) {
-			ip_bmap_mark_as_used(bno, 1 /* length */);
-		} else {
-			container_bmap_mark_as_used(bno, 1 /* length */);
-		}
+	if (vsb)
+		__atomic_fetch_add(&vsb->v_block_count, 1, __ATOMIC_RELAXED);
+	if ((obj->type == APFS_OBJECT_TYPE_SPACEMAN_CIB) ||
+	     (obj->type == APFS_OBJECT_TYPE_SPACEMAN_CAB)) {
+		ip_bmap_mark_as_used(bno, 1 /* length */);
+	} else {
+		container_bmap_mark_as_used(bno, 1 /* length */);
 	}
 
 	if (oid != obj->oid)
@@ -179,15 +221,13 @@ static void free_cpoint_map(struct htable_entry *entry)
 		report("Checkpoint map", "reserved object id.");
 	if (map->m_oid >= sb->s_next_oid)
 		report("Checkpoint map", "unassigned object id.");
-
-	free(entry);
 }
 
 /**
  * free_cpoint_map_table - Free the checkpoint map table and all its entries
  * @table: table to free
  */
-void free_cpoint_map_table(struct htable_entry **table)
+void free_cpoint_map_table(struct htable *table)
 {
 	free_htable(table, free_cpoint_map);
 }
@@ -3,14 +3,17 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <apfs/parameters.h>
 #include <apfs/raw.h>
 #include "apfsck.h"
+#include "bitmap.h"
+#include "block.h"
 #include "btree.h"
 #include "key.h"
 #include "object.h"
@@ -49,24 +52,39 @@ static bool range_in_ip(u64 paddr, u64 length)
 /**
  * bmap_mark_as_used - Set a range to ones in a bitmap
  * @bitmap:	the bitmap
+ * @base:	block number for the first bit of @bitmap
  * @paddr:	first block number
  * @length:	block count
  *
  * Checks that an address range is still zeroed in the given bitmap, and then
- * switches those bits.
+ * switches those bits.  This is done a whole word at a time, with partial
+ * masks only for the first and last words of the range.  The words are updated
+ * atomically, because the volumes may be checked by several threads at once.
  */
-static void bmap_mark_as_used(u64 *bitmap, u64 paddr, u64 length)
+static void bmap_mark_as_used(u64 *bitmap, u64 base, u64 paddr, u64 length)
 {
-	u64 *byte;
-	u64 flag;
+	u64 start = paddr - base;
+	u64 last = start + length - 1;
 	u64 i;
 
-	for (i = paddr; i < paddr + length; ++i) {
-		byte = bitmap + i / 64;
-		flag = 1ULL << i % 64;
-		if (*byte & flag)
-			report(NULL /* context */, "A block is used twice.");
-		*byte |= flag;
+	if (!length)
+		return;
+
+	for (i = start / 64; i <= last / 64; ++i) {
+		u64 mask = ~0ULL;
+		u64 used;
+
+		if (i == start / 64)
+			mask &= ~0ULL << (start % 64);
+		if (i == last / 64)
+			mask &= ~0ULL >> (63 - last % 64);
+
+		used = __atomic_fetch_or(&bitmap[i], mask, __ATOMIC_RELAXED);
+		used &= mask;
+		if (used)
+			report(NULL /* context */, "Block 0x%llx is used twice.",
+			       (unsigned long long)(base + i * 64 +
+						    __builtin_ctzll(used)));
 	}
 }
 
@@ -82,8 +100,8 @@ void ip_bmap_mark_as_used(u64 paddr, u64 length)
 {
 	if (!range_in_ip(paddr, length))
 		report(NULL /* context */, "Out-of-range ip block number.");
-	paddr -= sb->s_spaceman.sm_ip_base;
-	bmap_mark_as_used(sb->s_ip_bitmap, paddr, length);
+	bmap_mark_as_used(sb->s_ip_bitmap, sb->s_spaceman.sm_ip_base, paddr,
+			  length);
 }
 
 /**
@@ -92,15 +110,28 @@ void ip_bmap_mark_as_used(u64 paddr, u64 length)
  * @length:	block count
  *
  * Checks that the given address range is still marked as free in the
- * container's allocation bitmap, and then switches those bits.
+ * container's allocation bitmap, and then switches those bits.  The range is
+ * split at the boundaries of the leaves of the bitmap.
  */
 void container_bmap_mark_as_used(u64 paddr, u64 length)
 {
+	struct bitmap *bmap = sb->s_bitmap;
+
 	/* Avoid out-of-bounds writes to the allocation bitmap */
 	if (paddr + length >= sb->s_block_count || paddr + length < paddr)
 		report(NULL /* context */, "Out-of-range block number.");
 
-	bmap_mark_as_used(sb->s_bitmap, paddr, length);
+	while (length) {
+		u64 index = paddr / bmap->b_leaf_bits;
+		u64 base = index * bmap->b_leaf_bits;
+		u64 count = base + bmap->b_leaf_bits - paddr;
+
+		if (count > length)
+			count = length;
+		bmap_mark_as_used(bitmap_leaf(bmap, index), base, paddr, count);
+		paddr += count;
+		length -= count;
+	}
 }
 
 /**
@@ -140,84 +171,112 @@ static void parse_spaceman_chunk_counts(struct apfs_spaceman_phys *raw)
 		report("Space manager", "wrong size of internal pool.");
 }
 
+/* Maximum number of bitmap blocks in a single read, well below the limit */
+#define BITMAP_READ_MAX	256
+
+/*
+ * Bitmap block to be read for a chunk, and the buffer to receive it
+ */
+struct bitmap_read {
+	u64	r_bno;		/* Block number for the bitmap */
+	void	*r_buf;		/* Place of the bitmap in memory */
+};
+
+/**
+ * compare_bitmap_reads - Compare two bitmap reads by block number, for qsort()
+ * @a: pointer to the first read
+ * @b: pointer to the second read
+ */
+static int compare_bitmap_reads(const void *a, const void *b)
+{
+	const struct bitmap_read *read1 = a;
+	const struct bitmap_read *read2 = b;
+
+	if (read1->r_bno < read2->r_bno)
+		return -1;
+	return read1->r_bno > read2->r_bno;
+}
+
 /**
- * read_chunk_bitmap - Read a chunk's bitmap into memory
- * @addr: first block number for the chunk
- * @bmap: block number for the chunk's bitmap, or zero if the chunk is all free
+ * read_chunk_bitmaps - Read the bitmaps for a batch of chunks
+ * @reads:	array of bitmap reads, will be sorted
+ * @count:	number of reads in @reads
  *
- * Returns a pointer to the chunk's bitmap, read into its proper position
- * within the in-memory bitmap for the container.
+ * Runs of bitmap blocks that are consecutive on disk are read with a single
+ * call.  Each bitmap block is only read once, so the block cache is not used.
  */
-static void *read_chunk_bitmap(u64 addr, u64 bmap)
+static void read_chunk_bitmaps(struct bitmap_read *reads, int count)
 {
-	struct spaceman *sm = &sb->s_spaceman;
-	ssize_t read_bytes;
-	void *buf, *ret;
-	size_t count;
-	off_t offset;
-	u32 chunk_number;
+	struct iovec *iov;
+	int i, j;
+
+	if (!count)
+		return;
+	iov = calloc(count, sizeof(*iov));
+	if (!iov)
+		system_error();
 
-	assert(sm->sm_bitmap);
+	qsort(reads, count, sizeof(*reads), compare_bitmap_reads);
+	for (i = 0; i < count; i = j) {
+		for (j = i; j < count && j - i < BITMAP_READ_MAX; ++j) {
+			if (j > i && reads[j].r_bno != reads[j - 1].r_bno + 1)
+				break;
+			iov[j].iov_base = reads[j].r_buf;
+			iov[j].iov_len = sb->s_blocksize;
+		}
+		dev_readv(&iov[i], j - i, reads[i].r_bno * sb->s_blocksize);
+	}
+	free(iov);
+}
+
+/**
+ * chunk_bitmap_index - Find the leaf for a chunk in the container bitmap
+ * @addr: first block number for the chunk
+ */
+static u64 chunk_bitmap_index(u64 addr)
+{
+	struct spaceman *sm = &sb->s_spaceman;
+	u64 chunk_number;
 
-	/* Prevent out-of-bounds writes to sm->sm_bitmap */
+	/* Prevent out-of-bounds reads of the container bitmap */
 	if (addr & (sm->sm_blocks_per_chunk - 1))
 		report("Chunk-info", "chunk address isn't multiple of size.");
 	chunk_number = addr / sm->sm_blocks_per_chunk;
 	if (addr >= sb->s_block_count)
 		report("Chunk-info", "chunk address is out of bounds.");
 
-	ret = buf = sm->sm_bitmap + chunk_number * sb->s_blocksize;
-	if (!bmap) /* The whole chunk is free, so leave this block as zero */
-		return ret;
-
-	count = sb->s_blocksize;
-	offset = bmap * sb->s_blocksize;
-	do {
-		read_bytes = pread(fd, buf, count, offset);
-		if (read_bytes < 0)
-			system_error();
-		buf += read_bytes;
-		count -= read_bytes;
-		offset += read_bytes;
-	} while (read_bytes > 0);
-
-	/* Mark the bitmap block as used in the actual allocation bitmap */
-	ip_bmap_mark_as_used(bmap, 1 /* length */);
-	return ret;
+	return chunk_number;
 }
 
-/**
- * count_chunk_free - Count the free blocks in a chunk
- * @bmap: pointer to the chunk's bitmap
- * @blks: number of blocks in the chunk
+/*
+ * Totals for the chunks of a single chunk-info block, to be added to the ones
+ * for the whole device once the block is done
  */
-static int count_chunk_free(void *bmap, u32 blks)
-{
-	unsigned long long *curr, *end;
-	int free = blks;
-
-	end = bmap + sb->s_blocksize;
-	for (curr = bmap; curr < end; ++curr)
-		free -= __builtin_popcountll(*curr);
-	return free;
-}
+struct cib_totals {
+	u64 t_chunks;	/* Number of chunks */
+	u64 t_blocks;	/* Number of blocks */
+	u64 t_free;	/* Number of free blocks */
+};
 
 /**
  * parse_chunk_info - Parse and check a chunk info structure
  * @chunk:	pointer to the raw chunk info structure
  * @is_last:	is this the last chunk of the device?
  * @start:	expected first block number for the chunk
- * @xid:	on return, the transaction id of the chunk
+ * @totals:	totals for the chunk-info block, to be updated
+ * @read:	the read needed for the chunk's bitmap, if any; its buffer must
+ *		already be set
  *
- * Returns the first block number for the next chunk.
+ * The free block count can only be checked once the bitmap is read, so that
+ * is left for check_chunk_bitmap().  Returns true if @read is needed.
  */
-static u64 parse_chunk_info(struct apfs_chunk_info *chunk, bool is_last,
-			    u64 start, u64 *xid)
+static bool parse_chunk_info(struct apfs_chunk_info *chunk, bool is_last,
+			     u64 start, struct cib_totals *totals,
+			     struct bitmap_read *read)
 {
 	struct spaceman *sm = &sb->s_spaceman;
 	u32 block_count;
-	void *bitmap;
-	u32 free_count;
+	u64 bmap;
 
 	block_count = le32_to_cpu(chunk->ci_block_count);
 	if (!block_count)
@@ -226,41 +285,104 @@ static u64 parse_chunk_info(struct apfs_chunk_info *chunk, bool is_last,
 		report("Chunk-info", "too many blocks.");
 	if (!is_last && block_count != sm->sm_blocks_per_chunk)
 		report("Chunk-info", "too few blocks.");
-	sm->sm_blocks += block_count;
+	totals->t_blocks += block_count;
 
 	if (le64_to_cpu(chunk->ci_addr) != start)
 		report("Chunk-info block", "chunks are not consecutive.");
-	bitmap = read_chunk_bitmap(start, le64_to_cpu(chunk->ci_bitmap_addr));
+	chunk_bitmap_index(start);
+
+	if (!le64_to_cpu(chunk->ci_xid))
+		report("Chunk-info", "bad transaction id.");
+
+	bmap = le64_to_cpu(chunk->ci_bitmap_addr);
+	if (!bmap) /* The whole chunk is free, so there is no bitmap to read */
+		return false;
+	read->r_bno = bmap;
+
+	/* Mark the bitmap block as used in the actual allocation bitmap */
+	ip_bmap_mark_as_used(bmap, 1 /* length */);
+	return true;
+}
+
+/**
+ * check_chunk_bitmap - Check a chunk against its bitmap from the spaceman
+ * @chunk:	pointer to the raw chunk info structure
+ * @sm_bmap:	the chunk's bitmap as read from disk, or NULL if it has none
+ * @totals:	totals for the chunk-info block, to be updated
+ *
+ * The free blocks are counted and the bitmap is compared against the one
+ * assembled by the fsck in a single pass, so all blocks in use must have been
+ * marked by now.
+ */
+static void check_chunk_bitmap(struct apfs_chunk_info *chunk, u64 *sm_bmap,
+			       struct cib_totals *totals)
+{
+	struct spaceman *sm = &sb->s_spaceman;
+	u64 start = le64_to_cpu(chunk->ci_addr);
+	u64 *real_bmap;
+	u32 free_count, real_free;
+	u32 i;
+
+	real_bmap = bitmap_find_leaf(sb->s_bitmap,
+				     start / sm->sm_blocks_per_chunk);
+	real_free = le32_to_cpu(chunk->ci_block_count);
+
+	for (i = 0; i < sb->s_blocksize / sizeof(u64); ++i) {
+		u64 sm_word = sm_bmap ? sm_bmap[i] : 0;
+		u64 real_word = real_bmap ? real_bmap[i] : 0;
+
+		real_free -= __builtin_popcountll(sm_word);
+		if (sm_word == real_word)
+			continue;
+
+		/*
+		 * TODO: sometimes the bitmaps don't match; maybe this has
+		 * something to do with the file count issue mentioned at
+		 * check_container()?
+		 */
+		if (!__atomic_exchange_n(&sm->sm_bitmap_weird, true,
+					 __ATOMIC_RELAXED))
+			report_weird("Container allocation bitmap");
+
+		/* At least verify that all used blocks are marked as such */
+		if ((sm_word | real_word) != sm_word)
+			report("Space manager", "bad allocation bitmap.");
+	}
 
 	free_count = le32_to_cpu(chunk->ci_free_count);
-	if (free_count != count_chunk_free(bitmap, block_count))
+	if (free_count != real_free)
 		report("Chunk-info", "wrong count of free blocks.");
-	sm->sm_free += free_count;
-
-	*xid = le64_to_cpu(chunk->ci_xid);
-	if (!*xid)
-		report("Chunk-info", "bad transaction id.");
-	return start + block_count;
+	totals->t_free += free_count;
 }
 
 /**
  * parse_chunk_info_block - Parse and check a chunk-info block
  * @bno:	block number of the chunk-info block
  * @index:	index of the chunk-info block
- * @start:	expected first block number for the first chunk
+ * @totals:	on return, the totals for the chunks of the block
  *
- * Returns the first block number for the first chunk of the next cib.
+ * Only the last chunk-info block may have fewer chunks than the maximum, and
+ * only the last chunk may have fewer blocks, so the first block number for
+ * each chunk-info block is known in advance.  That way they can all be
+ * checked independently.  The bitmaps for the chunks are only kept in memory
+ * until they are checked.
  */
-static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
+static void parse_chunk_info_block(u64 bno, int index,
+				   struct cib_totals *totals)
 {
 	struct spaceman *sm = &sb->s_spaceman;
 	struct object obj;
 	struct apfs_chunk_info_block *cib;
+	struct bitmap_read *reads;
+	void *bitmaps;
 	u32 chunk_count;
 	bool last_cib = index == sm->sm_cib_count - 1;
-	u64 max_chunk_xid = 0;
+	u64 start, max_chunk_xid = 0;
+	int read_count = 0;
 	int i;
 
+	start = (u64)index * sm->sm_chunks_per_cib * sm->sm_blocks_per_chunk;
+
 	cib = read_object(bno, NULL, &obj);
 	if (obj.type != APFS_OBJECT_TYPE_SPACEMAN_CIB)
 		report("Chunk-info block", "wrong object type.");
@@ -279,17 +401,27 @@ static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
 		report("Chunk-info block", "too many chunks.");
 	if (!last_cib && chunk_count != sm->sm_chunks_per_cib)
 		report("Chunk-info block", "too few chunks.");
-	sm->sm_chunks += chunk_count;
+	totals->t_chunks = chunk_count;
+
+	reads = calloc(chunk_count, sizeof(*reads));
+	if (!reads)
+		system_error();
+	bitmaps = alloc_io_buffer(chunk_count * sb->s_blocksize);
 
 	for (i = 0; i < chunk_count; ++i) {
+		struct apfs_chunk_info *chunk = &cib->cib_chunk_info[i];
 		bool last_block = false;
 		u64 chunk_xid;
 
 		if (last_cib && i == chunk_count - 1)
 			last_block = true;
-		start = parse_chunk_info(&cib->cib_chunk_info[i], last_block,
-					 start, &chunk_xid);
+		reads[read_count].r_buf = bitmaps + i * sb->s_blocksize;
+		if (parse_chunk_info(chunk, last_block, start, totals,
+				     &reads[read_count]))
+			++read_count;
+		start += le32_to_cpu(chunk->ci_block_count);
 
+		chunk_xid = le64_to_cpu(chunk->ci_xid);
 		if (chunk_xid > obj.xid)
 			report("Chunk-info", "xid is too recent.");
 		if (chunk_xid > max_chunk_xid)
@@ -298,8 +430,20 @@ static u64 parse_chunk_info_block(u64 bno, int index, u64 start)
 	if (obj.xid != max_chunk_xid) /* Cib only changes if a chunk changes */
 		report("Chunk-info block", "xid is too recent.");
 
-	munmap(cib, sb->s_blocksize);
-	return start;
+	read_chunk_bitmaps(reads, read_count);
+	free(reads);
+
+	for (i = 0; i < chunk_count; ++i) {
+		struct apfs_chunk_info *chunk = &cib->cib_chunk_info[i];
+		void *bitmap = NULL;
+
+		if (chunk->ci_bitmap_addr)
+			bitmap = bitmaps + i * sb->s_blocksize;
+		check_chunk_bitmap(chunk, bitmap, totals);
+	}
+	free(bitmaps);
+
+	release_block(cib);
 }
 
 /**
@@ -353,6 +497,92 @@ static char *spaceman_256_from_off(struct apfs_spaceman_phys *raw, u32 offset)
 	return value_p;
 }
 
+/* Shared state for the threads that check the chunk-info blocks */
+static struct {
+	u64	*q_bnos;	/* Block numbers for all the cibs */
+	int	q_count;	/* Number of cibs */
+	int	q_next;		/* Next cib to be checked by a thread */
+} cib_queue;
+
+/**
+ * cib_worker - Thread function that checks cibs until none are left
+ * @arg: unused
+ *
+ * The totals for each cib are added to the ones for the device at the end.
+ */
+static void *cib_worker(void *arg)
+{
+	struct spaceman *sm = &sb->s_spaceman;
+	struct cib_totals totals = {0};
+	int cib;
+
+	(void)arg;
+	while (1) {
+		struct cib_totals cib_totals = {0};
+
+		cib = __atomic_fetch_add(&cib_queue.q_next, 1,
+					 __ATOMIC_RELAXED);
+		if (cib >= cib_queue.q_count)
+			break;
+		parse_chunk_info_block(cib_queue.q_bnos[cib], cib, &cib_totals);
+		totals.t_chunks += cib_totals.t_chunks;
+		totals.t_blocks += cib_totals.t_blocks;
+		totals.t_free += cib_totals.t_free;
+	}
+
+	__atomic_fetch_add(&sm->sm_chunks, totals.t_chunks, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sm->sm_blocks, totals.t_blocks, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&sm->sm_free, totals.t_free, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/**
+ * parse_chunk_info_blocks - Check all cibs for the main device, in parallel
+ * @raw:	pointer to the raw space manager
+ * @addr_off:	offset of the cib addresses in @raw
+ *
+ * The totals for the device are added up in the in-memory spaceman.
+ */
+static void parse_chunk_info_blocks(struct apfs_spaceman_phys *raw,
+				    u32 addr_off)
+{
+	struct spaceman *sm = &sb->s_spaceman;
+	pthread_t *threads;
+	int max_threads, thread_count = 0;
+	int i;
+
+	if (!sm->sm_cib_count)
+		return;
+
+	cib_queue.q_bnos = calloc(sm->sm_cib_count, sizeof(*cib_queue.q_bnos));
+	if (!cib_queue.q_bnos)
+		system_error();
+	for (i = 0; i < sm->sm_cib_count; ++i)
+		cib_queue.q_bnos[i] = spaceman_val_from_off(raw,
+						addr_off + i * sizeof(u64));
+	cib_queue.q_count = sm->sm_cib_count;
+	cib_queue.q_next = 0;
+
+	/* One of the jobs is the calling thread itself */
+	max_threads = jobs < sm->sm_cib_count ? jobs : sm->sm_cib_count;
+	max_threads = max_threads > 1 ? max_threads - 1 : 0;
+	threads = max_threads ? calloc(max_threads, sizeof(*threads)) : NULL;
+	if (max_threads && !threads)
+		system_error();
+	while (thread_count < max_threads) {
+		if (pthread_create(&threads[thread_count], NULL, cib_worker,
+				   NULL))
+			break;
+		++thread_count;
+	}
+	cib_worker(NULL);
+	for (i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(cib_queue.q_bnos);
+	cib_queue.q_bnos = NULL;
+}
+
 /**
  * parse_spaceman_main_device - Parse and check the spaceman main device struct
  * @raw: pointer to the raw space manager
@@ -361,9 +591,6 @@ static void parse_spaceman_main_device(struct apfs_spaceman_phys *raw)
 {
 	struct spaceman *sm = &sb->s_spaceman;
 	struct apfs_spaceman_device *dev = &raw->sm_dev[APFS_SD_MAIN];
-	u32 addr_off;
-	u64 start = 0;
-	int i;
 
 	if (dev->sm_cab_count)
 		report_unknown("Chunk-info address block");
@@ -374,13 +601,7 @@ static void parse_spaceman_main_device(struct apfs_spaceman_phys *raw)
 	if (le64_to_cpu(dev->sm_block_count) != sb->s_block_count)
 		report("Spaceman device", "wrong block count.");
 
-	addr_off = le32_to_cpu(dev->sm_addr_offset);
-	for (i = 0; i < sm->sm_cib_count; ++i) {
-		u64 bno = spaceman_val_from_off(raw,
-						addr_off + i * sizeof(u64));
-
-		start = parse_chunk_info_block(bno, i, start);
-	}
+	parse_chunk_info_blocks(raw, le32_to_cpu(dev->sm_addr_offset));
 
 	if (sm->sm_chunk_count != sm->sm_chunks)
 		report("Spaceman device", "bad total number of chunks.");
@@ -504,7 +725,7 @@ static void check_spaceman_free_queues(struct apfs_spaceman_free_queue *sfq)
 	if (le16_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_node_limit) <
 					sm->sm_ip_fq->sfq_btree.node_count)
 		report("Spaceman free queue", "node count above limit.");
-	if (le16_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_node_limit) != ip_fq_node_limit(sm->sm_chunks))
+	if (le16_to_cpu(sfq[APFS_SFQ_IP].sfq_tree_node_limit) != ip_fq_node_limit(sm->sm_chunk_count))
 		report("Spaceman free queue", "wrong node limit.");
 
 	sm->sm_main_fq = parse_free_queue_btree(
@@ -518,37 +739,10 @@ static void check_spaceman_free_queues(struct apfs_spaceman_free_queue *sfq)
 	if (le16_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_node_limit) <
 					sm->sm_main_fq->sfq_btree.node_count)
 		report("Spaceman free queue", "node count above limit.");
-	if (le16_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_node_limit) != main_fq_node_limit(sm->sm_blocks))
+	if (le16_to_cpu(sfq[APFS_SFQ_MAIN].sfq_tree_node_limit) != main_fq_node_limit(sb->s_block_count))
 		report("Spaceman free queue", "wrong node limit.");
 }
 
-/**
- * compare_container_bitmaps - Verify the container's allocation bitmap
- * @sm_bmap:	allocation bitmap reported by the space manager
- * @real_bmap:	allocation bitmap assembled by the fsck
- * @chunks:	container chunk count, i.e., block count for the bitmaps
- */
-static void compare_container_bitmaps(u64 *sm_bmap, u64 *real_bmap, u64 chunks)
-{
-	unsigned long long bmap_size = sb->s_blocksize * chunks;
-	unsigned long long count64;
-	u64 i;
-
-	/*
-	 * TODO: sometimes the bitmaps don't match; maybe this has something to
-	 * do with the file count issue mentioned at check_container()?
-	 */
-	if (!memcmp(sm_bmap, real_bmap, bmap_size))
-		return;
-	report_weird("Container allocation bitmap");
-
-	/* At least verify that all used blocks are marked as such */
-	count64 = bmap_size / sizeof(count64);
-	for (i = 0; i < count64; ++i)
-		if ((sm_bmap[i] | real_bmap[i]) != sm_bmap[i])
-			report("Space manager", "bad allocation bitmap.");
-}
-
 /**
  * check_ip_free_next - Check the free_next field for the internal pool
  * @free_next:	256-bit field to check
@@ -651,10 +845,7 @@ static void check_ip_bitmap_blocks(struct apfs_spaceman_phys *raw)
 		char *bmap;
 		int edge, j;
 
-		bmap = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			    fd, (bmap_base + i) * sb->s_blocksize);
-		if (bmap == MAP_FAILED)
-			system_error();
+		bmap = read_block(bmap_base + i);
 
 		/*
 		 * The edge is the last byte inside the allocation bitmap;
@@ -672,33 +863,46 @@ static void check_ip_bitmap_blocks(struct apfs_spaceman_phys *raw)
 				report("Internal pool", "non-zeroed bitmap.");
 		}
 
-		munmap(bmap, sb->s_blocksize);
+		release_block(bmap);
 	}
 }
 
+/**
+ * check_ip_bitmap - Compare the internal pool bitmap against the one assembled
+ * @bno: block number for the current internal pool bitmap
+ *
+ * All the blocks in the internal pool must have been marked by now.
+ */
+static void check_ip_bitmap(u64 bno)
+{
+	struct spaceman *sm = &sb->s_spaceman;
+	u64 ip_chunk_count;
+	u64 *pool_bmap;
+
+	ip_chunk_count = DIV_ROUND_UP(sm->sm_ip_block_count, 8 * sb->s_blocksize);
+	pool_bmap = read_block(bno);
+	if (memcmp(pool_bmap, sb->s_ip_bitmap, ip_chunk_count * sb->s_blocksize))
+		report("Space manager", "bad ip allocation bitmap.");
+	release_block(pool_bmap);
+}
+
 /**
  * check_internal_pool - Check the internal pool of blocks
  * @raw:	pointer to the raw space manager
+ *
+ * The current bitmap can't be checked until the chunks are parsed, because
+ * their bitmap blocks are in the pool.  Returns its block number.
  */
-static void check_internal_pool(struct apfs_spaceman_phys *raw)
+static u64 check_internal_pool(struct apfs_spaceman_phys *raw)
 {
-	u64 *pool_bmap;
 	u64 pool_base = le64_to_cpu(raw->sm_ip_base);
 	u64 pool_blocks = le64_to_cpu(raw->sm_ip_block_count);
-	u64 ip_chunk_count = DIV_ROUND_UP(pool_blocks, 8 * sb->s_blocksize);
+	u64 pool_bmap;
 	u64 xid;
 
-	pool_bmap = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			 fd, parse_ip_bitmap_list(raw) * sb->s_blocksize);
-	if (pool_bmap == MAP_FAILED)
-		system_error();
-
-	if (memcmp(pool_bmap, sb->s_ip_bitmap, ip_chunk_count * sb->s_blocksize))
-		report("Space manager", "bad ip allocation bitmap.");
+	pool_bmap = parse_ip_bitmap_list(raw);
 	container_bmap_mark_as_used(pool_base, pool_blocks);
 
-	munmap(pool_bmap, sb->s_blocksize);
-
 	if (le32_to_cpu(raw->sm_ip_bm_tx_multiplier) !=
 					APFS_SPACEMAN_IP_BM_TX_MULTIPLIER)
 		report("Space manager", "bad tx multiplier for internal pool.");
@@ -708,6 +912,7 @@ static void check_internal_pool(struct apfs_spaceman_phys *raw)
 		report("Internal pool", "bad transaction id.");
 
 	check_ip_bitmap_blocks(raw);
+	return pool_bmap;
 }
 
 /**
@@ -719,7 +924,7 @@ void check_spaceman(u64 oid)
 	struct spaceman *sm = &sb->s_spaceman;
 	struct object obj;
 	struct apfs_spaceman_phys *raw;
-	u64 ip_chunk_count;
+	u64 ip_chunk_count, ip_bmap;
 	u32 flags;
 
 	raw = read_ephemeral_object(oid, &obj);
@@ -728,6 +933,7 @@ void check_spaceman(u64 oid)
 	if (obj.subtype != APFS_OBJECT_TYPE_INVALID)
 		report("Space manager", "wrong object subtype.");
 	sm->sm_xid = obj.xid;
+	sm->sm_bitmap_weird = false;
 
 	sm->sm_ip_base = le64_to_cpu(raw->sm_ip_base);
 	sm->sm_ip_block_count = le64_to_cpu(raw->sm_ip_block_count);
@@ -755,23 +961,21 @@ void check_spaceman(u64 oid)
 		report("Space manager", "wrong block size.");
 	parse_spaceman_chunk_counts(raw);
 
-	/* All bitmaps will need to be read into memory */
-	sm->sm_bitmap = calloc(sm->sm_chunk_count, sb->s_blocksize);
-	if (!sm->sm_bitmap)
-		system_error();
-
+	/*
+	 * Each chunk gets compared against the container bitmap as soon as it
+	 * is parsed, so all other blocks in use must be marked before that.
+	 */
+	check_spaceman_free_queues(raw->sm_fq);
+	ip_bmap = check_internal_pool(raw);
 	parse_spaceman_main_device(raw);
 	check_spaceman_tier2_device(raw);
-	check_spaceman_free_queues(raw->sm_fq);
-	check_internal_pool(raw);
+	check_ip_bitmap(ip_bmap);
 	free(sb->s_ip_bitmap);
 
 	if (raw->sm_fs_reserve_block_count || raw->sm_fs_reserve_alloc_count)
 		report_unknown("Reserved allocation blocks");
 
-	compare_container_bitmaps(sm->sm_bitmap, sb->s_bitmap,
-				  sm->sm_chunk_count);
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 }
 
 /**
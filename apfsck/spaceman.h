@@ -13,7 +13,6 @@ struct apfs_spaceman_free_queue_key;
 
 /* Space manager data in memory */
 struct spaceman {
-	void *sm_bitmap; /* Allocation bitmap for the whole container */
 	struct free_queue *sm_ip_fq; /* Free queue for internal pool */
 	struct free_queue *sm_main_fq; /* Free queue for main device */
 	int sm_struct_size; /* Size of the spaceman structure on disk */
@@ -32,6 +31,7 @@ struct spaceman {
 	u64 sm_chunks;	/* Number of chunks */
 	u64 sm_blocks;	/* Number of blocks */
 	u64 sm_free;	/* Number of free blocks */
+	bool sm_bitmap_weird; /* Bitmap mismatch was already reported */
 };
 
 /*
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Performance counters and phase timers, reported as json with the -s option.
+ * None of this has any cost beyond a branch unless the report was requested.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <apfs/raw.h>
+#include "apfsck.h"
+#include "stats.h"
+#include "super.h"
+
+__thread struct stats_counters *thread_stats;
+
+/*
+ * Time taken by a phase of the check
+ */
+struct stats_phase {
+	const char		*p_name;	/* Name of the phase */
+	u64			p_xid;		/* Transaction of the checkpoint */
+	int			p_volume;	/* Volume index, or -1 if none */
+	u64			p_wall;		/* Wall clock time, in ns */
+	u64			p_cpu;		/* Cpu time for the thread, in ns */
+	struct stats_phase	*p_next;	/* Next phase to finish */
+};
+
+static struct {
+	struct stats_counters	*s_counters;	/* Counters for all threads */
+	struct stats_phase	*s_phases;	/* First phase to finish */
+	struct stats_phase	**s_tail;	/* Where to link the next phase */
+	pthread_mutex_t		s_lock;		/* Protects all of the above */
+} stats = {
+	.s_tail = &stats.s_phases,
+	.s_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Names of the tree types in the report */
+static const char *tree_names[STATS_TREE_COUNT] = {
+	[STATS_TREE_OMAP]	= "omap",
+	[STATS_TREE_CATALOG]	= "catalog",
+	[STATS_TREE_EXTENTREF]	= "extentref",
+	[STATS_TREE_SNAP_META]	= "snap_meta",
+	[STATS_TREE_FREE_QUEUE]	= "free_queue",
+	[STATS_TREE_OTHER]	= "other",
+};
+
+/**
+ * alloc_thread_stats - Set up the counters for the current thread
+ *
+ * They are never freed, so that they can be reported after the thread exits.
+ */
+struct stats_counters *alloc_thread_stats(void)
+{
+	struct stats_counters *counters;
+
+	counters = calloc(1, sizeof(*counters));
+	if (!counters)
+		system_error();
+
+	pthread_mutex_lock(&stats.s_lock);
+	counters->c_next = stats.s_counters;
+	stats.s_counters = counters;
+	pthread_mutex_unlock(&stats.s_lock);
+	return counters;
+}
+
+/**
+ * stats_count_object - Count an object that was read, by its tree type
+ * @type:	object type
+ * @subtype:	object subtype
+ */
+void stats_count_object(u32 type, u32 subtype)
+{
+	int tree = STATS_TREE_OTHER;
+
+	if (type == APFS_OBJECT_TYPE_BTREE ||
+	    type == APFS_OBJECT_TYPE_BTREE_NODE) {
+		switch (subtype) {
+		case APFS_OBJECT_TYPE_OMAP:
+			tree = STATS_TREE_OMAP;
+			break;
+		case APFS_OBJECT_TYPE_FSTREE:
+			tree = STATS_TREE_CATALOG;
+			break;
+		case APFS_OBJECT_TYPE_BLOCKREFTREE:
+			tree = STATS_TREE_EXTENTREF;
+			break;
+		case APFS_OBJECT_TYPE_SNAPMETATREE:
+			tree = STATS_TREE_SNAP_META;
+			break;
+		case APFS_OBJECT_TYPE_SPACEMAN_FREE_QUEUE:
+			tree = STATS_TREE_FREE_QUEUE;
+			break;
+		}
+	}
+	++get_thread_stats()->c_objects[tree];
+}
+
+/**
+ * stats_timer_start - Start timing a phase of the check
+ * @timer: the timer
+ */
+void stats_timer_start(struct stats_timer *timer)
+{
+	if (!stats_path)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &timer->t_wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timer->t_cpu);
+}
+
+/**
+ * timespec_since - Find the nanoseconds that passed since a given time
+ * @start:	the given time
+ * @clock:	clock to read the current time from
+ */
+static u64 timespec_since(struct timespec *start, clockid_t clock)
+{
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+	       now.tv_nsec - start->tv_nsec;
+}
+
+/**
+ * stats_timer_stop - Finish timing a phase of the check, and record it
+ * @timer:	the timer, set by stats_timer_start()
+ * @phase:	name of the phase
+ * @volume:	index of the volume for the phase, or -1 if none
+ *
+ * The cpu time only covers the calling thread, not any helpers it started.
+ */
+void stats_timer_stop(struct stats_timer *timer, const char *phase, int volume)
+{
+	struct stats_phase *record;
+
+	if (!stats_path)
+		return;
+
+	record = calloc(1, sizeof(*record));
+	if (!record)
+		system_error();
+	record->p_name = phase;
+	record->p_xid = sb ? sb->s_xid : 0;
+	record->p_volume = volume;
+	record->p_wall = timespec_since(&timer->t_wall, CLOCK_MONOTONIC);
+	record->p_cpu = timespec_since(&timer->t_cpu, CLOCK_THREAD_CPUTIME_ID);
+
+	pthread_mutex_lock(&stats.s_lock);
+	*stats.s_tail = record;
+	stats.s_tail = &record->p_next;
+	pthread_mutex_unlock(&stats.s_lock);
+}
+
+/**
+ * write_stats - Write the report to the file requested by the user
+ *
+ * Must be called once all threads are done.  The report goes to standard
+ * output if the filename is "-".
+ */
+void write_stats(void)
+{
+	struct stats_counters total = {0};
+	struct stats_counters *counters;
+	struct stats_phase *phase;
+	struct timespec zero = {0};
+	FILE *file;
+	int i;
+
+	if (!stats_path)
+		return;
+
+	for (counters = stats.s_counters; counters; counters = counters->c_next) {
+		for (i = 0; i < STATS_TREE_COUNT; ++i)
+			total.c_objects[i] += counters->c_objects[i];
+		total.c_cache_hits += counters->c_cache_hits;
+		total.c_cache_misses += counters->c_cache_misses;
+		total.c_device_bytes += counters->c_device_bytes;
+		total.c_csum_bytes += counters->c_csum_bytes;
+		total.c_htable_lookups += counters->c_htable_lookups;
+		total.c_htable_probes += counters->c_htable_probes;
+		if (counters->c_htable_max_probes > total.c_htable_max_probes)
+			total.c_htable_max_probes =
+						counters->c_htable_max_probes;
+		total.c_extref_lookups += counters->c_extref_lookups;
+	}
+
+	if (strcmp(stats_path, "-") == 0)
+		file = stdout;
+	else
+		file = fopen(stats_path, "w");
+	if (!file)
+		system_error();
+
+	fprintf(file, "{\n\t\"objects_read\": {");
+	for (i = 0; i < STATS_TREE_COUNT; ++i)
+		fprintf(file, "%s\n\t\t\"%s\": %llu", i ? "," : "",
+			tree_names[i], (unsigned long long)total.c_objects[i]);
+	fprintf(file, "\n\t},\n");
+	fprintf(file, "\t\"cache_hits\": %llu,\n",
+		(unsigned long long)total.c_cache_hits);
+	fprintf(file, "\t\"cache_misses\": %llu,\n",
+		(unsigned long long)total.c_cache_misses);
+	fprintf(file, "\t\"device_bytes\": %llu,\n",
+		(unsigned long long)total.c_device_bytes);
+	fprintf(file, "\t\"checksum_bytes\": %llu,\n",
+		(unsigned long long)total.c_csum_bytes);
+	fprintf(file, "\t\"htable_lookups\": %llu,\n",
+		(unsigned long long)total.c_htable_lookups);
+	fprintf(file, "\t\"htable_probes\": %llu,\n",
+		(unsigned long long)total.c_htable_probes);
+	fprintf(file, "\t\"htable_max_probes\": %llu,\n",
+		(unsigned long long)total.c_htable_max_probes);
+	fprintf(file, "\t\"extref_lookups\": %llu,\n",
+		(unsigned long long)total.c_extref_lookups);
+	fprintf(file, "\t\"process_cpu_ms\": %.3f,\n",
+		timespec_since(&zero, CLOCK_PROCESS_CPUTIME_ID) / 1e6);
+
+	fprintf(file, "\t\"phases\": [");
+	for (phase = stats.s_phases; phase; phase = phase->p_next) {
+		fprintf(file, "%s\n\t\t{ \"phase\": \"%s\", \"xid\": %llu, ",
+			phase == stats.s_phases ? "" : ",", phase->p_name,
+			(unsigned long long)phase->p_xid);
+		if (phase->p_volume >= 0)
+			fprintf(file, "\"volume\": %d, ", phase->p_volume);
+		fprintf(file, "\"wall_ms\": %.3f, \"cpu_ms\": %.3f }",
+			phase->p_wall / 1e6, phase->p_cpu / 1e6);
+	}
+	fprintf(file, "\n\t]\n}\n");
+
+	if (fclose(file))
+		system_error();
+}
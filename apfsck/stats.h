@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <time.h>
+#include <apfs/types.h>
+
+/* Tree types for the counts of objects read */
+#define STATS_TREE_OMAP		0	/* Object maps */
+#define STATS_TREE_CATALOG	1	/* Catalogs */
+#define STATS_TREE_EXTENTREF	2	/* Extent reference trees */
+#define STATS_TREE_SNAP_META	3	/* Snapshot metadata trees */
+#define STATS_TREE_FREE_QUEUE	4	/* Spaceman free queues */
+#define STATS_TREE_OTHER	5	/* Objects that are not tree nodes */
+#define STATS_TREE_COUNT	6
+
+/*
+ * Performance counters.  Each thread keeps its own, so that the hot paths
+ * don't have to share cache lines; they are only added up for the report.
+ */
+struct stats_counters {
+	u64	c_objects[STATS_TREE_COUNT]; /* Objects read, by tree type */
+	u64	c_cache_hits;		/* Blocks found in the block cache */
+	u64	c_cache_misses;		/* Blocks not found in the block cache */
+	u64	c_device_bytes;		/* Bytes read from the device */
+	u64	c_csum_bytes;		/* Bytes run through the checksum */
+	u64	c_htable_lookups;	/* Hash table lookups */
+	u64	c_htable_probes;	/* Slots visited by all lookups */
+	u64	c_htable_max_probes;	/* Slots visited by the longest lookup */
+	u64	c_extref_lookups;	/* Lookups in the extent reference list */
+
+	struct stats_counters *c_next;	/* Counters for another thread */
+};
+
+/*
+ * Start of a timed phase of the check
+ */
+struct stats_timer {
+	struct timespec	t_wall;		/* Wall clock time */
+	struct timespec	t_cpu;		/* Cpu time for the thread */
+};
+
+extern __thread struct stats_counters *thread_stats;
+
+extern struct stats_counters *alloc_thread_stats(void);
+extern void stats_count_object(u32 type, u32 subtype);
+extern void stats_timer_start(struct stats_timer *timer);
+extern void stats_timer_stop(struct stats_timer *timer, const char *phase,
+			     int volume);
+extern void write_stats(void);
+
+/**
+ * get_thread_stats - Get the counters for the current thread
+ */
+static inline struct stats_counters *get_thread_stats(void)
+{
+	if (!thread_stats)
+		thread_stats = alloc_thread_stats();
+	return thread_stats;
+}
+
+/* Add to a counter of the current thread, if stats were requested */
+#define STATS_ADD(field, n)					\
+	do {							\
+		if (stats_path)					\
+			get_thread_stats()->field += (n);	\
+	} while (0)
+
+#endif	/* _STATS_H */
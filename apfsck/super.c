@@ -4,27 +4,30 @@
 
 #include <assert.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <apfs/raw.h>
 #include <apfs/types.h>
 #include "apfsck.h"
+#include "bitmap.h"
+#include "block.h"
 #include "btree.h"
 #include "extents.h"
 #include "htable.h"
 #include "inode.h"
 #include "object.h"
 #include "spaceman.h"
+#include "stats.h"
 #include "super.h"
 
 struct super_block *sb;
-struct volume_superblock *vsb;
+__thread struct volume_superblock *vsb;
 
 /**
  * is_power_of_two - Check if a number is a power of two
@@ -71,21 +74,22 @@ static struct apfs_nx_superblock *read_super_copy(void)
 	 */
 	bsize_tmp = APFS_NX_DEFAULT_BLOCK_SIZE;
 
-	msb_raw = mmap(NULL, bsize_tmp, PROT_READ, MAP_PRIVATE,
-		       fd, APFS_NX_BLOCK_NUM * bsize_tmp);
-	if (msb_raw == MAP_FAILED)
+	msb_raw = malloc(bsize_tmp);
+	if (!msb_raw)
 		system_error();
+	dev_read(msb_raw, bsize_tmp, APFS_NX_BLOCK_NUM * bsize_tmp);
 	sb->s_blocksize = le32_to_cpu(msb_raw->nx_block_size);
-	sb->s_blocksize_bits = blksize_bits(sb->s_blocksize);
+	free(msb_raw);
 
-	if (sb->s_blocksize != bsize_tmp) {
-		munmap(msb_raw, bsize_tmp);
+	/* The block cache is built for this size, so it must be sane */
+	if (sb->s_blocksize < APFS_NX_MINIMUM_BLOCK_SIZE ||
+	    sb->s_blocksize > APFS_NX_MAXIMUM_BLOCK_SIZE ||
+	    !is_power_of_2(sb->s_blocksize))
+		report("Block zero", "invalid block size.");
+	sb->s_blocksize_bits = blksize_bits(sb->s_blocksize);
 
-		msb_raw = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			       fd, APFS_NX_BLOCK_NUM * sb->s_blocksize);
-		if (msb_raw == MAP_FAILED)
-			system_error();
-	}
+	/* Now the block cache can be used */
+	msb_raw = read_block(APFS_NX_BLOCK_NUM);
 
 	if (le32_to_cpu(msb_raw->nx_magic) != APFS_NX_MAGIC)
 		report("Block zero", "wrong magic.");
@@ -113,19 +117,18 @@ static struct apfs_nx_superblock *read_latest_super(u64 base, u32 blocks)
 	for (bno = base; bno < base + blocks; ++bno) {
 		struct apfs_nx_superblock *current;
 
-		current = mmap(NULL, sb->s_blocksize, PROT_READ, MAP_PRIVATE,
-			       fd, bno * sb->s_blocksize);
-		if (current == MAP_FAILED)
-			system_error();
+		current = read_block(bno);
 
-		if (le32_to_cpu(current->nx_magic) != APFS_NX_MAGIC)
-			continue; /* Not a superblock */
-		if (le64_to_cpu(current->nx_o.o_xid) <= xid)
-			continue; /* Old */
-		if (!obj_verify_csum(&current->nx_o))
-			continue; /* Corrupted */
+		if (le32_to_cpu(current->nx_magic) != APFS_NX_MAGIC ||
+		    le64_to_cpu(current->nx_o.o_xid) <= xid ||
+		    !obj_verify_csum(&current->nx_o)) {
+			/* Not a superblock, old, or corrupted */
+			release_block(current);
+			continue;
+		}
 
 		xid = le64_to_cpu(current->nx_o.o_xid);
+		release_block(latest);
 		latest = current;
 	}
 
@@ -303,7 +306,7 @@ static void check_efi_information(u64 oid)
 	if (file_length <= (block_count - 1) * sb->s_blocksize)
 		report("EFI info", "wasted space in driver extents.");
 
-	munmap(efi, sb->s_blocksize);
+	release_block(efi);
 }
 
 /**
@@ -605,6 +608,135 @@ static struct apfs_superblock *map_volume_super(int vol,
 	return vsb->v_raw;
 }
 
+/**
+ * check_volume - Check a whole volume, after its superblock was mapped
+ * @vol_sb: the volume superblock structure
+ *
+ * Volumes are independent of each other, so this may be called from several
+ * threads at once; each one keeps its own @vsb.
+ */
+static void check_volume(struct volume_superblock *vol_sb)
+{
+	struct apfs_superblock *vsb_raw = vol_sb->v_raw;
+	int index = le32_to_cpu(vsb_raw->apfs_fs_index);
+	struct stats_timer vol_timer, timer;
+
+	vsb = vol_sb;
+	stats_timer_start(&vol_timer);
+
+	/* Check for corruption in the volume object map... */
+	stats_timer_start(&timer);
+	vsb->v_omap = parse_omap_btree(le64_to_cpu(vsb_raw->apfs_omap_oid));
+	stats_timer_stop(&timer, "omap", index);
+	/* ...in the extent reference tree... */
+	stats_timer_start(&timer);
+	vsb->v_extent_ref = parse_extentref_btree(
+				le64_to_cpu(vsb_raw->apfs_extentref_tree_oid));
+	stats_timer_stop(&timer, "extentref", index);
+	/* ...in the catalog... */
+	stats_timer_start(&timer);
+	vsb->v_cat = parse_cat_btree(le64_to_cpu(vsb_raw->apfs_root_tree_oid),
+				     vsb->v_omap_table);
+	stats_timer_stop(&timer, "catalog", index);
+	/* ...and in the snapshot metadata tree */
+	stats_timer_start(&timer);
+	vsb->v_snap_meta = parse_snap_meta_btree(
+				le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid));
+	stats_timer_stop(&timer, "snap_meta", index);
+
+	free_inode_table(vsb->v_inode_table);
+	vsb->v_inode_table = NULL;
+	free_dstream_table(vsb->v_dstream_table);
+	vsb->v_dstream_table = NULL;
+	free_cnid_table(vsb->v_cnid_table);
+	vsb->v_cnid_table = NULL;
+	free_extent_table(vsb->v_extent_table);
+	vsb->v_extent_table = NULL;
+	free_omap_table(vsb->v_omap_table);
+	vsb->v_omap_table = NULL;
+	free(vsb->v_extrefs);
+	vsb->v_extrefs = NULL;
+	/* All the final checks are done, so drop the records in one go */
+	free_arena(vsb->v_arena);
+	vsb->v_arena = NULL;
+
+	if (!vsb->v_has_root)
+		report("Catalog", "the root directory is missing.");
+	if (!vsb->v_has_priv)
+		report("Catalog", "the private directory is missing.");
+
+	if (le64_to_cpu(vsb_raw->apfs_num_files) != vsb->v_file_count)
+		/* Sometimes this is off by one.  TODO: why? */
+		report_weird("File count in volume superblock");
+	if (le64_to_cpu(vsb_raw->apfs_num_directories) != vsb->v_dir_count)
+		report("Volume superblock", "bad directory count.");
+	if (le64_to_cpu(vsb_raw->apfs_num_symlinks) != vsb->v_symlink_count)
+		report("Volume superblock", "bad symlink count.");
+	if (le64_to_cpu(vsb_raw->apfs_num_other_fsobjects) !=
+							vsb->v_special_count)
+		report("Volume superblock", "bad special file count.");
+	if (le64_to_cpu(vsb_raw->apfs_fs_alloc_count) !=
+							vsb->v_block_count - 1)
+		/* The volume superblock itself does not count */
+		report("Volume superblock", "bad block count.");
+
+	stats_timer_stop(&vol_timer, "volume", index);
+	vsb = NULL;
+}
+
+/* Shared state for the threads that check the volumes of a container */
+static struct {
+	int	v_count;	/* Number of volumes in the container */
+	int	v_next;		/* Next volume to be checked by a thread */
+} volume_queue;
+
+/**
+ * volume_worker - Thread function that checks volumes until none are left
+ * @arg: unused
+ */
+static void *volume_worker(void *arg)
+{
+	int vol;
+
+	(void)arg;
+	while (1) {
+		vol = __atomic_fetch_add(&volume_queue.v_next, 1,
+					 __ATOMIC_RELAXED);
+		if (vol >= volume_queue.v_count)
+			return NULL;
+		check_volume(sb->s_volumes[vol]);
+	}
+}
+
+/**
+ * check_all_volumes - Check all the volumes of a container
+ * @vol_count: number of volumes, already mapped in @sb->s_volumes
+ *
+ * Up to @jobs volumes get checked at the same time, each on its own thread.
+ * The calling thread takes part as well, so it can do all the work on its own
+ * if no other threads can be started.
+ */
+static void check_all_volumes(int vol_count)
+{
+	pthread_t threads[APFS_NX_MAX_FILE_SYSTEMS];
+	int thread_count = 0;
+	int i;
+
+	volume_queue.v_count = vol_count;
+	volume_queue.v_next = 0;
+
+	while (thread_count + 1 < jobs && thread_count + 1 < vol_count) {
+		if (pthread_create(&threads[thread_count], NULL, volume_worker,
+				   NULL))
+			break;
+		++thread_count;
+	}
+
+	volume_worker(NULL);
+	for (i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
 static struct object *parse_reaper(u64 oid);
 
 /**
@@ -613,89 +745,48 @@ static struct object *parse_reaper(u64 oid);
  */
 static void check_container(struct super_block *sb)
 {
+	struct stats_timer timer;
 	int vol;
 
-	sb->s_omap_table = alloc_htable();
+	sb->s_omap_table = alloc_htable(sb->s_arena);
 
 	/* Check for corruption in the container object map... */
+	stats_timer_start(&timer);
 	sb->s_omap = parse_omap_btree(le64_to_cpu(sb->s_raw->nx_omap_oid));
+	stats_timer_stop(&timer, "omap", -1 /* volume */);
 	/* ...and in the reaper */
 	sb->s_reaper = parse_reaper(le64_to_cpu(sb->s_raw->nx_reaper_oid));
 
+	/* The volume superblocks are found through the shared container omap */
 	for (vol = 0; vol < APFS_NX_MAX_FILE_SYSTEMS; ++vol) {
-		struct apfs_superblock *vsb_raw;
-
 		vsb = calloc(1, sizeof(*vsb));
 		if (!vsb)
 			system_error();
-		vsb->v_omap_table = alloc_htable();
-		vsb->v_extent_table = alloc_htable();
-		vsb->v_cnid_table = alloc_htable();
-		vsb->v_dstream_table = alloc_htable();
-		vsb->v_inode_table = alloc_htable();
-
-		vsb_raw = map_volume_super(vol, vsb);
-		if (!vsb_raw) {
+		vsb->v_arena = alloc_arena();
+		vsb->v_omap_table = alloc_htable(vsb->v_arena);
+		vsb->v_extent_table = alloc_htable(vsb->v_arena);
+		vsb->v_cnid_table = alloc_htable(vsb->v_arena);
+		vsb->v_dstream_table = alloc_htable(vsb->v_arena);
+		vsb->v_inode_table = alloc_htable(vsb->v_arena);
+
+		if (!map_volume_super(vol, vsb)) {
+			free_arena(vsb->v_arena);
 			free(vsb);
 			break;
 		}
-
-		/* Check for corruption in the volume object map... */
-		vsb->v_omap = parse_omap_btree(
-				le64_to_cpu(vsb_raw->apfs_omap_oid));
-		/* ...in the extent reference tree... */
-		vsb->v_extent_ref = parse_extentref_btree(
-				le64_to_cpu(vsb_raw->apfs_extentref_tree_oid));
-		/* ...in the catalog... */
-		vsb->v_cat = parse_cat_btree(
-				le64_to_cpu(vsb_raw->apfs_root_tree_oid),
-				vsb->v_omap_table);
-		/* ...and in the snapshot metadata tree */
-		vsb->v_snap_meta = parse_snap_meta_btree(
-				le64_to_cpu(vsb_raw->apfs_snap_meta_tree_oid));
-
-		free_inode_table(vsb->v_inode_table);
-		vsb->v_inode_table = NULL;
-		free_dstream_table(vsb->v_dstream_table);
-		vsb->v_dstream_table = NULL;
-		free_cnid_table(vsb->v_cnid_table);
-		vsb->v_cnid_table = NULL;
-		free_extent_table(vsb->v_extent_table);
-		vsb->v_extent_table = NULL;
-		free_omap_table(vsb->v_omap_table);
-		vsb->v_omap_table = NULL;
-
-		if (!vsb->v_has_root)
-			report("Catalog", "the root directory is missing.");
-		if (!vsb->v_has_priv)
-			report("Catalog", "the private directory is missing.");
-
-		if (le64_to_cpu(vsb_raw->apfs_num_files) !=
-							vsb->v_file_count)
-			/* Sometimes this is off by one.  TODO: why? */
-			report_weird("File count in volume superblock");
-		if (le64_to_cpu(vsb_raw->apfs_num_directories) !=
-							vsb->v_dir_count)
-			report("Volume superblock", "bad directory count.");
-		if (le64_to_cpu(vsb_raw->apfs_num_symlinks) !=
-							vsb->v_symlink_count)
-			report("Volume superblock", "bad symlink count.");
-		if (le64_to_cpu(vsb_raw->apfs_num_other_fsobjects) !=
-							vsb->v_special_count)
-			report("Volume superblock", "bad special file count.");
-		if (le64_to_cpu(vsb_raw->apfs_fs_alloc_count) !=
-							vsb->v_block_count - 1)
-			/* The volume superblock itself does not count */
-			report("Volume superblock", "bad block count.");
-
 		sb->s_volumes[vol] = vsb;
 	}
 	vsb = NULL;
 
+	/* Everything else in a volume is independent of the other volumes */
+	check_all_volumes(vol);
+
 	free_omap_table(sb->s_omap_table);
 	sb->s_omap_table = NULL;
 
+	stats_timer_start(&timer);
 	check_spaceman(le64_to_cpu(sb->s_raw->nx_spaceman_oid));
+	stats_timer_stop(&timer, "spaceman", -1 /* volume */);
 }
 
 /**
@@ -704,7 +795,6 @@ static void check_container(struct super_block *sb)
  */
 static void parse_main_super(struct super_block *sb)
 {
-	u64 chunk_count;
 	u64 keybag_bno, keybag_blocks;
 	int i;
 
@@ -716,7 +806,9 @@ static void parse_main_super(struct super_block *sb)
 	if (sb->s_xid != le64_to_cpu(sb->s_raw->nx_o.o_xid))
 		report("Container superblock", "inconsistent xid.");
 
-	sb->s_blocksize = le32_to_cpu(sb->s_raw->nx_block_size);
+	/* The block cache was already built with the size from block zero */
+	if (le32_to_cpu(sb->s_raw->nx_block_size) != sb->s_blocksize)
+		report("Container superblock", "inconsistent block size.");
 	if (sb->s_blocksize != APFS_NX_DEFAULT_BLOCK_SIZE)
 		report_unknown("Block size other than 4096");
 
@@ -728,13 +820,10 @@ static void parse_main_super(struct super_block *sb)
 
 	/*
 	 * A chunk is the disk section covered by a single block in the
-	 * allocation bitmap.
+	 * allocation bitmap.  Only the chunks in use get a leaf in memory.
 	 */
-	chunk_count = DIV_ROUND_UP(sb->s_block_count, 8 * sb->s_blocksize);
-	sb->s_bitmap = calloc(chunk_count, sb->s_blocksize);
-	if (!sb->s_bitmap)
-		system_error();
-	((char *)sb->s_bitmap)[0] = 0x01; /* Block zero is always used */
+	sb->s_bitmap = alloc_bitmap(sb->s_block_count, 8 * sb->s_blocksize);
+	container_bmap_mark_as_used(0, 1); /* Block zero is always used */
 
 	sb->s_max_vols = get_max_volumes(sb->s_block_count * sb->s_blocksize);
 	if (sb->s_max_vols != le32_to_cpu(sb->s_raw->nx_max_file_systems))
@@ -848,7 +937,7 @@ static u32 parse_cpoint_map_blocks(u64 desc_base, u32 desc_blocks, u32 *index)
 	assert(!sb->s_xid);
 
 	assert(!sb->s_cpoint_map_table);
-	sb->s_cpoint_map_table = alloc_htable();
+	sb->s_cpoint_map_table = alloc_htable(sb->s_arena);
 
 	while (1) {
 		u64 bno = desc_base + *index;
@@ -881,7 +970,7 @@ static u32 parse_cpoint_map_blocks(u64 desc_base, u32 desc_blocks, u32 *index)
 
 		flags = le32_to_cpu(raw->cpm_flags);
 
-		munmap(raw, sb->s_blocksize);
+		release_block(raw);
 		blk_count++;
 		*index = (*index + 1) % desc_blocks;
 
@@ -904,6 +993,7 @@ void parse_filesystem(void)
 	u32 desc_blocks;
 	long long valid_blocks;
 	u32 desc_next, desc_index, index;
+	struct stats_timer timer;
 
 	sb = calloc(1, sizeof(*sb));
 	if (!sb)
@@ -930,7 +1020,7 @@ void parse_filesystem(void)
 	if (desc_next >= desc_blocks || desc_index >= desc_blocks)
 		report("Checkpoint superblock",
 		       "out of range checkpoint descriptors.");
-	munmap(msb_raw_latest, sb->s_blocksize);
+	release_block(msb_raw_latest);
 	msb_raw_latest = NULL;
 
 	/*
@@ -946,16 +1036,21 @@ void parse_filesystem(void)
 		u32 map_blocks;
 
 		/* Some fields from the previous checkpoint need to be unset */
-		if (sb->s_raw)
-			munmap(sb->s_raw, sb->s_blocksize);
+		release_block(sb->s_raw);
 		sb->s_raw = NULL;
 		sb->s_xid = 0;
-		free(sb->s_bitmap);
+		free_bitmap(sb->s_bitmap);
+		sb->s_bitmap = NULL;
+		sb->s_arena = alloc_arena();
+		sb->s_spaceman.sm_chunks = 0;
+		sb->s_spaceman.sm_blocks = 0;
+		sb->s_spaceman.sm_free = 0;
 
 		/* The checkpoint-mapping blocks come before the superblock */
 		map_blocks = parse_cpoint_map_blocks(desc_base, desc_blocks,
 						     &index);
 		valid_blocks -= map_blocks;
+		sb->s_last_cpoint = valid_blocks <= 1;
 
 		bno = desc_base + index;
 		raw = read_object_nocheck(bno, &obj);
@@ -972,30 +1067,48 @@ void parse_filesystem(void)
 			report("Checkpoint superblock",
 			       "wrong checkpoint descriptor block count.");
 
-		sb->s_raw = raw;
-		parse_main_super(sb);
+		if ((options & OPT_LATEST_ONLY) && !sb->s_last_cpoint) {
+			/* Only the descriptors get checked for older ones */
+			if (obj.xid != sb->s_xid)
+				report("Container superblock",
+				       "inconsistent xid.");
+			release_block(raw);
+
+			/* The mappings were never used, so don't check that */
+			free_htable(sb->s_cpoint_map_table, NULL);
+		} else {
+			sb->s_raw = raw;
+			parse_main_super(sb);
 
-		/* Do this now, after parse_main_super() allocated the bitmap */
-		container_bmap_mark_as_used(desc_base, desc_blocks);
-		container_bmap_mark_as_used(sb->s_data_base, sb->s_data_blocks);
+			/* Do this now, after parse_main_super() set the bitmap */
+			container_bmap_mark_as_used(desc_base, desc_blocks);
+			container_bmap_mark_as_used(sb->s_data_base,
+						    sb->s_data_blocks);
 
-		check_container(sb);
+			stats_timer_start(&timer);
+			check_container(sb);
+			stats_timer_stop(&timer, "container", -1 /* volume */);
 
-		free_cpoint_map_table(sb->s_cpoint_map_table);
+			free_cpoint_map_table(sb->s_cpoint_map_table);
+		}
 		sb->s_cpoint_map_table = NULL;
+		free_arena(sb->s_arena);
+		sb->s_arena = NULL;
 
 		/* One more block for the checkpoint superblock itself */
 		index = (index + 1) % desc_blocks;
 		valid_blocks--;
 	}
 
+	free_verified_nodes();
+
 	if (valid_blocks != 0)
 		report("Block zero", "bad index for checkpoint descriptors.");
 
 	if (!sb->s_raw)
 		report("Checkpoint descriptor area", "no valid superblocks.");
 	main_super_compare(sb->s_raw, msb_raw_copy);
-	munmap(msb_raw_copy, sb->s_blocksize);
+	release_block(msb_raw_copy);
 }
 
 /**
@@ -1048,6 +1161,6 @@ static struct object *parse_reaper(u64 oid)
 			report_unknown("Nonempty reaper");
 	}
 
-	munmap(raw, sb->s_blocksize);
+	release_block(raw);
 	return reaper;
 }
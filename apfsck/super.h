@@ -7,21 +7,31 @@
 
 #include <apfs/raw.h>
 #include <apfs/types.h>
+#include "arena.h"
 #include "htable.h"
 #include "object.h"
 #include "spaceman.h"
 
+struct bitmap;
+struct extref_record;
+
 struct volume_superblock {
 	struct apfs_superblock *v_raw;
 	struct btree *v_omap;
 	struct btree *v_cat;
 	struct btree *v_extent_ref;
 	struct btree *v_snap_meta;
-	struct htable_entry **v_omap_table;	/* Hash table of omap records */
-	struct htable_entry **v_inode_table;	/* Hash table of all inodes */
-	struct htable_entry **v_dstream_table;	/* Hash table of all dstreams */
-	struct htable_entry **v_cnid_table;	/* Hash table of all cnids */
-	struct htable_entry **v_extent_table;	/* Hash table of all extents */
+	struct htable *v_omap_table;	/* Hash table of omap records */
+	struct htable *v_inode_table;	/* Hash table of all inodes */
+	struct htable *v_dstream_table;	/* Hash table of all dstreams */
+	struct htable *v_cnid_table;	/* Hash table of all cnids */
+	struct htable *v_extent_table;	/* Hash table of all extents */
+	struct arena *v_arena;		/* Memory for the volume's records */
+
+	/* Physical extents from the extentref tree, sorted by address */
+	struct extref_record *v_extrefs;
+	u64 v_extref_count;		/* Number of entries in v_extrefs */
+	u64 v_extref_finger;		/* Index of the last extent found */
 
 	/* Volume stats as measured by the fsck */
 	u64 v_file_count;	/* Number of files */
@@ -43,7 +53,7 @@ struct volume_superblock {
 /* Superblock data in memory */
 struct super_block {
 	struct apfs_nx_superblock *s_raw;
-	void *s_bitmap;	/* Allocation bitmap for the whole container */
+	struct bitmap *s_bitmap; /* Allocation bitmap for the whole container */
 	void *s_ip_bitmap; /* Allocation bitmap for the internal pool */
 	struct btree *s_omap;
 	struct object *s_reaper;
@@ -57,11 +67,14 @@ struct super_block {
 	u32 s_data_blocks; /* Number of blocks in the checkpoint data area */
 	u32 s_data_index; /* Index of first valid block in checkpoint data */
 	u32 s_data_len; /* Number of valid blocks in checkpoint data area */
+	bool s_last_cpoint; /* Is this the last checkpoint to be checked? */
 
 	/* Hash table of ephemeral object mappings for the checkpoint */
-	struct htable_entry **s_cpoint_map_table;
+	struct htable *s_cpoint_map_table;
 	/* Hash table of virtual object mappings for the container */
-	struct htable_entry **s_omap_table;
+	struct htable *s_omap_table;
+	/* Memory for the container records of the checkpoint */
+	struct arena *s_arena;
 
 	struct spaceman s_spaceman; /* Information about the space manager */
 
@@ -85,7 +98,7 @@ struct cpoint_map {
 
 static inline bool apfs_is_case_insensitive(void)
 {
-	extern struct volume_superblock *vsb;
+	extern __thread struct volume_superblock *vsb;
 
 	return (vsb->v_raw->apfs_incompatible_features &
 		cpu_to_le64(APFS_INCOMPAT_CASE_INSENSITIVE)) != 0;
@@ -93,7 +106,7 @@ static inline bool apfs_is_case_insensitive(void)
 
 static inline bool apfs_is_normalization_insensitive(void)
 {
-	extern struct volume_superblock *vsb;
+	extern __thread struct volume_superblock *vsb;
 	u64 flags = le64_to_cpu(vsb->v_raw->apfs_incompatible_features);
 
 	if (apfs_is_case_insensitive())
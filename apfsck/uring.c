@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Batched reads through io_uring, so that many requests can be in flight at
+ * the same time.  There is no dependency on liburing: the ring is set up and
+ * driven with the raw system calls.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <apfs/types.h>
+#include "apfsck.h"
+#include "block.h"
+#include "stats.h"
+#include "uring.h"
+
+/*
+ * The ring, shared by all threads.  Each slot of the queue has its own
+ * registered buffer, so that the kernel doesn't need to map user memory for
+ * each request; the data gets copied to its final destination on completion.
+ */
+static struct {
+	int			u_fd;		/* File descriptor for the ring */
+	unsigned int		u_depth;	/* Number of slots in the ring */
+
+	unsigned int		*u_sq_head;	/* Head of the submission queue */
+	unsigned int		*u_sq_tail;	/* Tail of the submission queue */
+	unsigned int		u_sq_mask;	/* Mask for submission indexes */
+	unsigned int		*u_sq_array;	/* Indexes of submitted entries */
+	struct io_uring_sqe	*u_sqes;	/* Submission queue entries */
+
+	unsigned int		*u_cq_head;	/* Head of the completion queue */
+	unsigned int		*u_cq_tail;	/* Tail of the completion queue */
+	unsigned int		u_cq_mask;	/* Mask for completion indexes */
+	struct io_uring_cqe	*u_cqes;	/* Completion queue entries */
+
+	void			*u_bufs;	/* Registered buffers, in a row */
+	size_t			u_bufsize;	/* Size of each buffer */
+	int			*u_free;	/* Stack of unused slots */
+	struct read_req		**u_owner;	/* Request for each busy slot */
+
+	pthread_mutex_t		u_lock;		/* Only one batch at a time */
+} ring = {
+	.u_fd = -1,
+	.u_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * uring_map - Map one of the regions shared with the kernel
+ * @size:	size of the region
+ * @offset:	magic offset that identifies the region
+ *
+ * Returns a pointer to the mapping, or NULL on failure.
+ */
+static void *uring_map(size_t size, off_t offset)
+{
+	void *ret;
+
+	ret = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring.u_fd, offset);
+	return ret == MAP_FAILED ? NULL : ret;
+}
+
+/**
+ * uring_init - Set up the ring
+ * @depth:	maximum number of reads in flight
+ * @bufsize:	maximum size of each read
+ *
+ * Returns false if io_uring is not available on this system, so that the
+ * caller can fall back to plain reads.  Any resources taken are leaked in that
+ * case, but it only happens once.
+ */
+bool uring_init(unsigned int depth, size_t bufsize)
+{
+	struct io_uring_params params = {0};
+	struct iovec *iovs;
+	size_t sq_size, cq_size;
+	void *sq_ring, *cq_ring;
+	unsigned int i;
+
+	ring.u_fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring.u_fd < 0)
+		return false;
+	ring.u_depth = params.sq_entries;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	cq_size = params.cq_off.cqes +
+		  params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		sq_ring = cq_ring = uring_map(sq_size, IORING_OFF_SQ_RING);
+	} else {
+		sq_ring = uring_map(sq_size, IORING_OFF_SQ_RING);
+		cq_ring = uring_map(cq_size, IORING_OFF_CQ_RING);
+	}
+	ring.u_sqes = uring_map(params.sq_entries * sizeof(*ring.u_sqes),
+				IORING_OFF_SQES);
+	if (!sq_ring || !cq_ring || !ring.u_sqes)
+		return false;
+
+	ring.u_sq_head = sq_ring + params.sq_off.head;
+	ring.u_sq_tail = sq_ring + params.sq_off.tail;
+	ring.u_sq_mask = *(u32 *)(sq_ring + params.sq_off.ring_mask);
+	ring.u_sq_array = sq_ring + params.sq_off.array;
+	ring.u_cq_head = cq_ring + params.cq_off.head;
+	ring.u_cq_tail = cq_ring + params.cq_off.tail;
+	ring.u_cq_mask = *(u32 *)(cq_ring + params.cq_off.ring_mask);
+	ring.u_cqes = cq_ring + params.cq_off.cqes;
+
+	ring.u_bufsize = bufsize;
+	if (posix_memalign(&ring.u_bufs, sysconf(_SC_PAGESIZE),
+			   ring.u_depth * bufsize))
+		system_error();
+	ring.u_free = malloc(ring.u_depth * sizeof(*ring.u_free));
+	ring.u_owner = calloc(ring.u_depth, sizeof(*ring.u_owner));
+	iovs = malloc(ring.u_depth * sizeof(*iovs));
+	if (!ring.u_free || !ring.u_owner || !iovs)
+		system_error();
+
+	for (i = 0; i < ring.u_depth; ++i) {
+		iovs[i].iov_base = ring.u_bufs + i * bufsize;
+		iovs[i].iov_len = bufsize;
+		ring.u_free[i] = i;
+	}
+	if (syscall(__NR_io_uring_register, ring.u_fd, IORING_REGISTER_BUFFERS,
+		    iovs, ring.u_depth) < 0) {
+		free(iovs);
+		return false;
+	}
+	free(iovs);
+	return true;
+}
+
+/**
+ * uring_queue_read - Add a read to the submission queue
+ * @req:	the read request
+ * @slot:	slot of the ring to use for it
+ */
+static void uring_queue_read(struct read_req *req, int slot)
+{
+	unsigned int tail = *ring.u_sq_tail;
+	unsigned int index = tail & ring.u_sq_mask;
+	struct io_uring_sqe *sqe = &ring.u_sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)(ring.u_bufs + slot * ring.u_bufsize);
+	sqe->len = req->r_len;
+	sqe->off = req->r_offset;
+	sqe->buf_index = slot;
+	sqe->user_data = slot;
+	ring.u_sq_array[index] = index;
+	ring.u_owner[slot] = req;
+
+	/* The kernel must see the entry before the new tail */
+	__atomic_store_n(ring.u_sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * uring_reap - Process all the reads that have completed
+ * @free_count:	number of unused slots, to be updated
+ *
+ * Returns the number of requests that were completed.
+ */
+static int uring_reap(int *free_count)
+{
+	unsigned int head = *ring.u_cq_head;
+	unsigned int tail = __atomic_load_n(ring.u_cq_tail, __ATOMIC_ACQUIRE);
+	int done = 0;
+
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &ring.u_cqes[head & ring.u_cq_mask];
+		int slot = cqe->user_data;
+		struct read_req *req = ring.u_owner[slot];
+		int res = cqe->res;
+
+		/* Retry failed reads the slow way, to get a proper error */
+		if (res < 0)
+			res = 0;
+		STATS_ADD(c_device_bytes, res);
+		memcpy(req->r_buf, ring.u_bufs + slot * ring.u_bufsize, res);
+
+		/* Short reads are rare, so just finish them the slow way too */
+		if (res < req->r_len)
+			dev_read(req->r_buf + res, req->r_len - res,
+				 req->r_offset + res);
+
+		ring.u_free[(*free_count)++] = slot;
+		++done;
+	}
+	__atomic_store_n(ring.u_cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+/**
+ * uring_read_batch - Read a batch of byte ranges from the device
+ * @reqs:	array of read requests
+ * @count:	number of requests in @reqs
+ *
+ * Keeps as many reads in flight as the ring allows, and returns once all of
+ * them are complete.  Requests that don't fit in a registered buffer are just
+ * read synchronously.
+ */
+void uring_read_batch(struct read_req *reqs, int count)
+{
+	int free_count, pending = 0, done = 0;
+	int next = 0, reaped;
+
+	pthread_mutex_lock(&ring.u_lock);
+	free_count = ring.u_depth;
+
+	while (done < count) {
+		int to_submit = 0;
+		int flags = 0;
+
+		while (next < count && free_count > 0) {
+			struct read_req *req = &reqs[next++];
+
+			if (req->r_len > ring.u_bufsize) {
+				dev_read(req->r_buf, req->r_len, req->r_offset);
+				++done;
+				continue;
+			}
+			uring_queue_read(req, ring.u_free[--free_count]);
+			++to_submit;
+		}
+		pending += to_submit;
+
+		/* The ring is full or there is nothing left, so wait */
+		if (pending)
+			flags |= IORING_ENTER_GETEVENTS;
+
+		while (to_submit || flags) {
+			int ret;
+
+			ret = syscall(__NR_io_uring_enter, ring.u_fd, to_submit,
+				      flags ? 1 : 0, flags, NULL, 0);
+			if (ret < 0)
+				system_error();
+			to_submit -= ret;
+			flags = 0;
+		}
+
+		reaped = uring_reap(&free_count);
+		pending -= reaped;
+		done += reaped;
+	}
+
+	pthread_mutex_unlock(&ring.u_lock);
+}
@@ -0,0 +1,16 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct read_req;
+
+extern bool uring_init(unsigned int depth, size_t bufsize);
+extern void uring_read_batch(struct read_req *reqs, int count);
+
+#endif	/* _URING_H */
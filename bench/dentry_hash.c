@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Micro-benchmark for the filename hash.  The hash of every name in a list is
+ * computed both by dentry_hash(), with its ascii fast path, and by a plain
+ * walk of the normalization trie, as it was done before.  The results must
+ * agree.  The names are read from a file, one per line, if one is given;
+ * otherwise a synthetic list is used.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <apfs/checksum.h>
+#include <apfs/types.h>
+#include <apfs/unicode.h>
+
+/* Number of names in the synthetic list */
+#define BENCH_NAMES	100000
+/* Number of passes over the whole list */
+#define BENCH_PASSES	20
+
+/**
+ * dentry_hash_trie - Find the key hash for a filename, without the fast path
+ * @name:	filename to hash
+ * @case_fold:	should the name be case-folded before hashing?
+ */
+static u32 dentry_hash_trie(const char *name, bool case_fold)
+{
+	struct unicursor cursor;
+	u32 hash = 0xFFFFFFFF;
+
+	init_unicursor(&cursor, name);
+
+	while (1) {
+		unicode_t utf32;
+
+		utf32 = normalize_next(&cursor, case_fold);
+		if (!utf32)
+			break;
+
+		hash = crc32c(hash, &utf32, sizeof(utf32));
+	}
+
+	/* Leave room for the filename length */
+	return (hash & 0x3FFFFF) << 10;
+}
+
+/* Pieces for the synthetic names */
+static const char *ascii_stems[] = {
+	"IMG_", "DSC", "README", "Makefile", "index", "main", "libapfs",
+	"Screenshot 2019-05-14 at ", "invoice-", "report_final_v", ".DS_Store",
+	"node_modules", "CMakeLists",
+};
+static const char *intl_stems[] = {
+	"Résumé ", "Überweisung ", "café-menu-", "naïve_bayes_", "写真",
+	"データ", "Фото ", "Ελληνικά-",
+};
+static const char *exts[] = {
+	"", ".jpg", ".JPG", ".c", ".h", ".txt", ".pdf", ".md", ".so.1",
+	".tar.gz", ".plist", ".mp3",
+};
+
+/**
+ * synthetic_names - Build a list of made-up filenames
+ * @count: number of names to build
+ */
+static char **synthetic_names(int count)
+{
+	char **names;
+	int i;
+
+	names = calloc(count, sizeof(*names));
+	if (!names) {
+		perror(NULL);
+		exit(1);
+	}
+	srandom(0);
+	for (i = 0; i < count; ++i) {
+		const char *stem, *ext;
+
+		/* Real filesystems are mostly ascii, so keep the rest rare */
+		if (random() % 20)
+			stem = ascii_stems[random() % (sizeof(ascii_stems) /
+						      sizeof(ascii_stems[0]))];
+		else
+			stem = intl_stems[random() % (sizeof(intl_stems) /
+						     sizeof(intl_stems[0]))];
+		ext = exts[random() % (sizeof(exts) / sizeof(exts[0]))];
+
+		if (asprintf(&names[i], "%s%ld%s", stem, random() % 100000,
+			     ext) < 0) {
+			perror(NULL);
+			exit(1);
+		}
+	}
+	return names;
+}
+
+/**
+ * read_names - Read a list of filenames from a file, one per line
+ * @path:	path to the file
+ * @count:	on return, the number of names read
+ */
+static char **read_names(const char *path, int *count)
+{
+	char **names = NULL;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	*count = 0;
+	while ((len = getline(&line, &size, file)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+		/* The same limit applies to names on disk */
+		if (!len || len > 255)
+			continue;
+		names = realloc(names, (*count + 1) * sizeof(*names));
+		if (!names) {
+			perror(NULL);
+			exit(1);
+		}
+		names[(*count)++] = strdup(line);
+	}
+	free(line);
+	fclose(file);
+	return names;
+}
+
+/**
+ * time_now - Read the monotonic clock, in seconds
+ */
+static double time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * time_hash - Measure the cost of a hash over the whole list of names
+ * @hash:	the hash function
+ * @case_fold:	should the names be case-folded?
+ * @names:	the list of names
+ * @count:	number of names in @names
+ *
+ * Returns the average time per name, in nanoseconds.
+ */
+static double time_hash(u32 (*hash)(const char *, bool), bool case_fold,
+			char **names, int count)
+{
+	volatile u32 sink = 0;
+	double start;
+	int pass, i;
+
+	start = time_now();
+	for (pass = 0; pass < BENCH_PASSES; ++pass) {
+		for (i = 0; i < count; ++i)
+			sink ^= hash(names[i], case_fold);
+	}
+	(void)sink;
+	return (time_now() - start) * 1e9 / BENCH_PASSES / count;
+}
+
+int main(int argc, char *argv[])
+{
+	char **names;
+	int count, i, fold;
+	int failed = 0;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [names_file]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == 2) {
+		names = read_names(argv[1], &count);
+	} else {
+		count = BENCH_NAMES;
+		names = synthetic_names(count);
+	}
+	if (!count) {
+		fprintf(stderr, "%s: no names to hash\n", argv[0]);
+		exit(1);
+	}
+
+	for (fold = 0; fold < 2; ++fold) {
+		const char *mode = fold ? "case-insensitive" : "case-sensitive";
+		double trie, fast;
+
+		for (i = 0; i < count; ++i) {
+			if (dentry_hash(names[i], fold) ==
+			    dentry_hash_trie(names[i], fold))
+				continue;
+			printf("%s: MISMATCH for \"%s\"\n", mode, names[i]);
+			failed = 1;
+		}
+
+		trie = time_hash(dentry_hash_trie, fold, names, count);
+		fast = time_hash(dentry_hash, fold, names, count);
+		printf("%-17s trie %7.1f ns/name, fast path %7.1f ns/name "
+		       "(%.2fx)\n", mode, trie, fast, trie / fast);
+	}
+
+	for (i = 0; i < count; ++i)
+		free(names[i]);
+	free(names);
+	return failed;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2019 Ernesto A. Fernández <ernesto.mnd.fernandez@gmail.com>
+ *
+ * Micro-benchmark for the Fletcher-64 implementations.  Each variant that the
+ * cpu supports gets timed on the same in-memory buffer, after its results are
+ * checked against the scalar loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <apfs/checksum.h>
+#include <apfs/types.h>
+
+/* Size of the buffer to checksum, in bytes */
+#define BENCH_BUFSIZE	(64 << 20)
+/* Size of each checksummed piece, as for a typical block */
+#define BENCH_BLOCKSIZE	4096
+/* Number of passes over the whole buffer */
+#define BENCH_PASSES	8
+
+/**
+ * variant_agrees - Check a Fletcher-64 variant against the scalar loop
+ * @variant:	the variant
+ * @buf:	random data, of size BENCH_BUFSIZE
+ *
+ * Tries every length up to a few blocks, so that the tails get covered, and
+ * then the whole buffer.
+ */
+static bool variant_agrees(int variant, char *buf)
+{
+	unsigned long len;
+
+	for (len = 0; len <= 4 * BENCH_BLOCKSIZE; len += sizeof(u32)) {
+		if (fletcher64_variant(variant, buf + 4, len) !=
+		    fletcher64_variant(FLETCHER64_SCALAR, buf + 4, len))
+			return false;
+	}
+	return fletcher64_variant(variant, buf, BENCH_BUFSIZE) ==
+	       fletcher64_variant(FLETCHER64_SCALAR, buf, BENCH_BUFSIZE);
+}
+
+/**
+ * time_now - Read the monotonic clock, in seconds
+ */
+static double time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * variant_rate - Measure the throughput of a Fletcher-64 variant, in GB/s
+ * @variant:	the variant
+ * @buf:	data to checksum, of size BENCH_BUFSIZE
+ */
+static double variant_rate(int variant, char *buf)
+{
+	volatile u64 sink = 0;
+	double start, elapsed;
+	int pass, off;
+
+	start = time_now();
+	for (pass = 0; pass < BENCH_PASSES; ++pass) {
+		for (off = 0; off < BENCH_BUFSIZE; off += BENCH_BLOCKSIZE)
+			sink += fletcher64_variant(variant, buf + off,
+						   BENCH_BLOCKSIZE);
+	}
+	elapsed = time_now() - start;
+	(void)sink;
+
+	return (double)BENCH_PASSES * BENCH_BUFSIZE / elapsed / 1e9;
+}
+
+int main(void)
+{
+	char *buf;
+	int failed = 0;
+	int i;
+
+	buf = malloc(BENCH_BUFSIZE);
+	if (!buf) {
+		perror(NULL);
+		exit(1);
+	}
+	srandom(0);
+	for (i = 0; i < BENCH_BUFSIZE; ++i)
+		buf[i] = random();
+
+	for (i = 0; i < FLETCHER64_VARIANTS; ++i) {
+		const char *name = fletcher64_variant_name(i);
+
+		if (!fletcher64_variant_supported(i)) {
+			printf("%-10s not supported by this cpu\n", name);
+			continue;
+		}
+		if (!variant_agrees(i, buf)) {
+			printf("%-10s MISMATCH with the scalar loop\n", name);
+			failed = 1;
+			continue;
+		}
+		printf("%-10s %6.2f GB/s\n", name, variant_rate(i, buf));
+	}
+
+	free(buf);
+	return failed;
+}
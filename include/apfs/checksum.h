@@ -7,7 +7,17 @@
 
 #include <apfs/types.h>
 
+/* Implementations of Fletcher-64, from slowest to fastest */
+#define FLETCHER64_SCALAR	0 /* One word at a time */
+#define FLETCHER64_UNROLLED	1 /* Four words at a time, in plain C */
+#define FLETCHER64_SSE41	2 /* Two lanes of SSE4.1 */
+#define FLETCHER64_AVX2		3 /* Four lanes of AVX2 */
+#define FLETCHER64_VARIANTS	4
+
 extern u32 crc32c(u32 crc, const void *buf, int size);
 extern u64 fletcher64(void *addr, unsigned long len);
+extern u64 fletcher64_variant(int variant, void *addr, unsigned long len);
+extern bool fletcher64_variant_supported(int variant);
+extern const char *fletcher64_variant_name(int variant);
 
 #endif /* _CHECKSUM_H */
@@ -20,5 +20,8 @@ struct unicursor {
 
 extern void init_unicursor(struct unicursor *cursor, const char *utf8str);
 extern unicode_t normalize_next(struct unicursor *cursor, bool case_fold);
+extern int normalize_ascii(struct unicursor *cursor, unicode_t *buf, int max,
+			   bool case_fold);
+extern u32 dentry_hash(const char *name, bool case_fold);
 
 #endif	/* _UNICODE_H */
@@ -5,6 +5,11 @@
 #include <apfs/checksum.h>
 #include <apfs/types.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
 /*
  * Implementation of the crc32c algorithm, adapted and simplified.
  *
@@ -79,34 +84,337 @@ static const u32 crc32Table[256] = {
 	0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-u32 crc32c(u32 crc, const void *buf, int size)
+/*
+ * Extra tables for the slice-by-8 variant: crc32Slices[k][n] is the crc of
+ * byte n followed by k zero bytes.  They are built from crc32Table on startup.
+ */
+static u32 crc32Slices[8][256];
+
+/**
+ * crc32c_init_slices - Build the tables for the slice-by-8 crc32c
+ */
+static void crc32c_init_slices(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc32Slices[0][i] = crc32Table[i];
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			u32 prev = crc32Slices[k - 1][i];
+
+			crc32Slices[k][i] = crc32Table[prev & 0xff] ^ (prev >> 8);
+		}
+	}
+}
+
+/**
+ * crc32c_bytes - Update a crc32c one byte at a time
+ * @crc:	current crc
+ * @p:		data to add
+ * @size:	length of the data
+ */
+static u32 crc32c_bytes(u32 crc, const void *buf, int size)
 {
 	const u8 *p = buf;
 
 	while (size--)
 		crc = crc32Table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/**
+ * get_le32 - Read a little-endian 32-bit value from a byte buffer
+ * @p: the buffer, with no alignment requirements
+ */
+static inline u32 get_le32(const u8 *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+/**
+ * crc32c_slice8 - Update a crc32c eight bytes at a time
+ * @crc:	current crc
+ * @buf:	data to add
+ * @size:	length of the data
+ */
+static u32 crc32c_slice8(u32 crc, const void *buf, int size)
+{
+	const u8 *p = buf;
+
+	while (size >= 8) {
+		u32 lo = crc ^ get_le32(p);
+		u32 hi = get_le32(p + 4);
+
+		crc = crc32Slices[7][lo & 0xff] ^
+		      crc32Slices[6][(lo >> 8) & 0xff] ^
+		      crc32Slices[5][(lo >> 16) & 0xff] ^
+		      crc32Slices[4][lo >> 24] ^
+		      crc32Slices[3][hi & 0xff] ^
+		      crc32Slices[2][(hi >> 8) & 0xff] ^
+		      crc32Slices[1][(hi >> 16) & 0xff] ^
+		      crc32Slices[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+	return crc32c_bytes(crc, p, size);
+}
 
+#ifdef CHECKSUM_X86
+
+/**
+ * crc32c_sse42 - Update a crc32c with the dedicated cpu instruction
+ * @crc:	current crc
+ * @buf:	data to add
+ * @size:	length of the data
+ */
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const void *buf, int size)
+{
+	const u8 *p = buf;
+
+#ifdef __x86_64__
+	u64 crc64 = crc;
+
+	for (; size >= 8; p += 8, size -= 8)
+		crc64 = _mm_crc32_u64(crc64, *(const u64 *)p);
+	crc = crc64;
+#endif
+	for (; size >= 4; p += 4, size -= 4)
+		crc = _mm_crc32_u32(crc, *(const u32 *)p);
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
 	return crc;
 }
 
+#endif /* CHECKSUM_X86 */
+
+/* The fastest crc32c implementation supported by this cpu */
+static u32 (*crc32c_impl)(u32 crc, const void *buf, int size) = crc32c_bytes;
+
+u32 crc32c(u32 crc, const void *buf, int size)
+{
+	return crc32c_impl(crc, buf, size);
+}
+
 /*
  * Implementation of the Fletcher-64 checksum, as used in APFS.
  *
  * Author: Gabriel Krisman Bertazi <krisman@collabora.co.uk>
  * Based on the Fletcher64 implementation from linux/drivers/nvdimm.
+ *
+ * The data is handled as a sequence of 32-bit words: sum1 is the sum of all of
+ * them, and sum2 the sum of all the partial values of sum1.  So out of n words
+ * the one at position i gets counted n - i times in sum2.  The faster variants
+ * below add up several words at a time using this fact.  All the arithmetic is
+ * modulo 2^64, so the results are identical to those of the simple loop.
  */
-u64 fletcher64(void *addr, unsigned long len)
+
+/**
+ * fletcher64_sums_simple - Add a sequence of words to the Fletcher-64 sums
+ * @buff:	the words
+ * @count:	number of words
+ * @sum1:	first sum, to be updated
+ * @sum2:	second sum, to be updated
+ */
+static void fletcher64_sums_simple(__le32 *buff, unsigned long count,
+				   u64 *sum1, u64 *sum2)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++) {
+		*sum1 += le32_to_cpu(buff[i]);
+		*sum2 += *sum1;
+	}
+}
+
+/**
+ * fletcher64_sums_unrolled - Add four words at a time to the Fletcher-64 sums
+ * @buff:	the words
+ * @count:	number of words
+ * @sum1:	first sum, to be updated
+ * @sum2:	second sum, to be updated
+ */
+static void fletcher64_sums_unrolled(__le32 *buff, unsigned long count,
+				     u64 *sum1, u64 *sum2)
+{
+	u64 s1 = *sum1, s2 = *sum2;
+	unsigned long i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		u64 w0 = le32_to_cpu(buff[i]);
+		u64 w1 = le32_to_cpu(buff[i + 1]);
+		u64 w2 = le32_to_cpu(buff[i + 2]);
+		u64 w3 = le32_to_cpu(buff[i + 3]);
+
+		s2 += 4 * s1 + 4 * w0 + 3 * w1 + 2 * w2 + w3;
+		s1 += w0 + w1 + w2 + w3;
+	}
+
+	*sum1 = s1;
+	*sum2 = s2;
+	fletcher64_sums_simple(buff + i, count - i, sum1, sum2);
+}
+
+#ifdef CHECKSUM_X86
+
+/**
+ * fletcher64_sums_sse41 - Add two words at a time to the Fletcher-64 sums
+ * @buff:	the words
+ * @count:	number of words
+ * @sum1:	first sum, to be updated
+ * @sum2:	second sum, to be updated
+ *
+ * Each of the two lanes keeps its own sums for one word out of every two;
+ * after k steps, the word at position 2 * j + l was counted k - j times in
+ * lane l of @s2v, while it should count for 2 * (k - j) - l.
+ */
+__attribute__((target("sse4.1")))
+static void fletcher64_sums_sse41(__le32 *buff, unsigned long count,
+				  u64 *sum1, u64 *sum2)
+{
+	__m128i s1v = _mm_setzero_si128();
+	__m128i s2v = _mm_setzero_si128();
+	u64 s1[2], s2[2];
+	unsigned long i;
+
+	for (i = 0; i + 2 <= count; i += 2) {
+		__m128i w = _mm_cvtepu32_epi64(
+				_mm_loadl_epi64((__m128i *)(buff + i)));
+
+		s1v = _mm_add_epi64(s1v, w);
+		s2v = _mm_add_epi64(s2v, s1v);
+	}
+	_mm_storeu_si128((__m128i *)s1, s1v);
+	_mm_storeu_si128((__m128i *)s2, s2v);
+
+	*sum2 += i * *sum1 + 2 * (s2[0] + s2[1]) - s1[1];
+	*sum1 += s1[0] + s1[1];
+	fletcher64_sums_simple(buff + i, count - i, sum1, sum2);
+}
+
+/**
+ * fletcher64_sums_avx2 - Add four words at a time to the Fletcher-64 sums
+ * @buff:	the words
+ * @count:	number of words
+ * @sum1:	first sum, to be updated
+ * @sum2:	second sum, to be updated
+ *
+ * Same as fletcher64_sums_sse41(), but with four lanes.
+ */
+__attribute__((target("avx2")))
+static void fletcher64_sums_avx2(__le32 *buff, unsigned long count,
+				 u64 *sum1, u64 *sum2)
+{
+	__m256i s1v = _mm256_setzero_si256();
+	__m256i s2v = _mm256_setzero_si256();
+	u64 s1[4], s2[4];
+	unsigned long i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m256i w = _mm256_cvtepu32_epi64(
+				_mm_loadu_si128((__m128i *)(buff + i)));
+
+		s1v = _mm256_add_epi64(s1v, w);
+		s2v = _mm256_add_epi64(s2v, s1v);
+	}
+	_mm256_storeu_si256((__m256i *)s1, s1v);
+	_mm256_storeu_si256((__m256i *)s2, s2v);
+
+	*sum2 += i * *sum1 + 4 * (s2[0] + s2[1] + s2[2] + s2[3]) -
+		 (s1[1] + 2 * s1[2] + 3 * s1[3]);
+	*sum1 += s1[0] + s1[1] + s1[2] + s1[3];
+	fletcher64_sums_simple(buff + i, count - i, sum1, sum2);
+}
+
+#endif /* CHECKSUM_X86 */
+
+/* All the Fletcher-64 implementations, indexed by variant */
+static void (*const fletcher64_impls[FLETCHER64_VARIANTS])(__le32 *buff,
+			unsigned long count, u64 *sum1, u64 *sum2) = {
+	[FLETCHER64_SCALAR]	= fletcher64_sums_simple,
+	[FLETCHER64_UNROLLED]	= fletcher64_sums_unrolled,
+#ifdef CHECKSUM_X86
+	[FLETCHER64_SSE41]	= fletcher64_sums_sse41,
+	[FLETCHER64_AVX2]	= fletcher64_sums_avx2,
+#endif
+};
+
+static const char *const fletcher64_names[FLETCHER64_VARIANTS] = {
+	[FLETCHER64_SCALAR]	= "scalar",
+	[FLETCHER64_UNROLLED]	= "unrolled",
+	[FLETCHER64_SSE41]	= "sse4.1",
+	[FLETCHER64_AVX2]	= "avx2",
+};
+
+/* Which variants this cpu supports, and the fastest of them */
+static bool fletcher64_supported[FLETCHER64_VARIANTS] = {
+	[FLETCHER64_SCALAR]	= true,
+	[FLETCHER64_UNROLLED]	= true,
+};
+static int fletcher64_best = FLETCHER64_UNROLLED;
+
+/**
+ * checksum_select - Pick the checksum implementations for this cpu
+ */
+__attribute__((constructor)) static void checksum_select(void)
+{
+	int variant;
+
+	crc32c_init_slices();
+	crc32c_impl = crc32c_slice8;
+
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_sse42;
+	fletcher64_supported[FLETCHER64_SSE41] =
+					__builtin_cpu_supports("sse4.1");
+	fletcher64_supported[FLETCHER64_AVX2] = __builtin_cpu_supports("avx2");
+#endif
+
+	/* The variants are listed from slowest to fastest */
+	for (variant = 0; variant < FLETCHER64_VARIANTS; ++variant) {
+		if (fletcher64_supported[variant])
+			fletcher64_best = variant;
+	}
+}
+
+/**
+ * fletcher64_variant_supported - Check if the cpu can run a Fletcher-64 variant
+ * @variant: the variant
+ */
+bool fletcher64_variant_supported(int variant)
+{
+	return variant >= 0 && variant < FLETCHER64_VARIANTS &&
+	       fletcher64_supported[variant];
+}
+
+/**
+ * fletcher64_variant_name - Get a printable name for a Fletcher-64 variant
+ * @variant: the variant
+ */
+const char *fletcher64_variant_name(int variant)
+{
+	return fletcher64_names[variant];
+}
+
+/**
+ * fletcher64_variant - Compute the Fletcher-64 checksum with a given variant
+ * @variant:	the variant, which must be supported by the cpu
+ * @addr:	data to checksum
+ * @len:	length of the data, in bytes
+ *
+ * Only meant for benchmarks and comparisons; everything else should just call
+ * fletcher64(), which picks the fastest variant.
+ */
+u64 fletcher64_variant(int variant, void *addr, unsigned long len)
 {
-	__le32 *buff = addr;
 	u64 sum1 = 0;
 	u64 sum2 = 0;
 	u64 c1, c2;
-	int i;
 
-	for (i = 0; i < len/sizeof(u32); i++) {
-		sum1 += le32_to_cpu(buff[i]);
-		sum2 += sum1;
-	}
+	fletcher64_impls[variant](addr, len / sizeof(u32), &sum1, &sum2);
 
 	c1 = sum1 + sum2;
 	c1 = 0xFFFFFFFF - c1 % 0xFFFFFFFF;
@@ -115,3 +423,8 @@ u64 fletcher64(void *addr, unsigned long len)
 
 	return (c2 << 32) | c1;
 }
+
+u64 fletcher64(void *addr, unsigned long len)
+{
+	return fletcher64_variant(fletcher64_best, addr, len);
+}
@@ -6,6 +6,8 @@
  */
 
 #include <ctype.h>
+#include <string.h>
+#include <apfs/checksum.h>
 #include <apfs/unicode.h>
 
 /*
@@ -391,6 +393,97 @@ new_starter:
 	}
 }
 
+#define ASCII_ONES	0x0101010101010101ULL
+#define ASCII_HIGHS	0x8080808080808080ULL
+
+/**
+ * normalize_ascii - Return all the leading ascii characters of a string
+ * @cursor:	unicode cursor for the string
+ * @buf:	array to receive the normalized characters
+ * @max:	maximum number of characters to return
+ * @case_fold:	case fold the string?
+ *
+ * Ascii characters are always starters, and they are not changed by
+ * normalization other than case folding, so the whole run can be handled at
+ * once, eight bytes at a time.  Returns the number of characters written to
+ * @buf and moves @cursor past them; that number is 0 if the next character is
+ * not ascii, or if the string is over.  The rest of the string must then be
+ * retrieved with normalize_next().
+ */
+int normalize_ascii(struct unicursor *cursor, unicode_t *buf, int max,
+		    bool case_fold)
+{
+	const char *utf8str = cursor->utf8curr;
+	int len, i = 0;
+
+	/* Don't interrupt the reordering of a substring */
+	if (cursor->length >= 0)
+		return 0;
+
+	len = strnlen(utf8str, max);
+	for (; i + 8 <= len; i += 8) {
+		__le64 raw;
+		u64 word;
+		int j;
+
+		memcpy(&raw, utf8str + i, sizeof(raw));
+		word = le64_to_cpu(raw);
+		if (word & ASCII_HIGHS)
+			break;
+		if (case_fold) {
+			/* The high bit is set in each byte between 'A' and 'Z' */
+			u64 upper = (word + (0x80 - 'A') * ASCII_ONES) ^
+				    (word + (0x80 - 'Z' - 1) * ASCII_ONES);
+
+			word |= (upper & ASCII_HIGHS) >> 2;
+		}
+		for (j = 0; j < 8; j++)
+			buf[i + j] = (u8)(word >> (8 * j));
+	}
+	for (; i < len; i++) {
+		if (!isascii(utf8str[i]))
+			break;
+		buf[i] = case_fold ? tolower(utf8str[i]) : utf8str[i];
+	}
+
+	cursor->utf8curr = utf8str + i;
+	return i;
+}
+
+/**
+ * dentry_hash - Find the key hash for a given filename
+ * @name:	filename to hash
+ * @case_fold:	should the name be case-folded before hashing?
+ */
+u32 dentry_hash(const char *name, bool case_fold)
+{
+	struct unicursor cursor;
+	u32 hash = 0xFFFFFFFF;
+
+	init_unicursor(&cursor, name);
+
+	while (1) {
+		unicode_t utf32[64];
+		int count;
+
+		/* Most names are ascii, so hash them in big chunks */
+		count = normalize_ascii(&cursor, utf32, 64, case_fold);
+		if (count) {
+			hash = crc32c(hash, utf32, count * sizeof(*utf32));
+			continue;
+		}
+
+		utf32[0] = normalize_next(&cursor, case_fold);
+		if (!utf32[0])
+			break;
+
+		hash = crc32c(hash, utf32, sizeof(*utf32));
+	}
+
+	/* Leave room for the filename length */
+	return (hash & 0x3FFFFF) << 10;
+}
+
 /*
  * The following arrays were built with data provided by the Unicode Standard,
  * version 9.0.